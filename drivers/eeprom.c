@@ -31,16 +31,25 @@
 // private defines
 //
 
+// maximum number of bytes compared or requests ended per interrupt,
+// the interrupt being raised again at once while EERIE is set
+#ifndef NNK_EEP_STEPS
+# define NNK_EEP_STEPS	8
+#endif
+
 
 //------------------------------
 // private variables
 //
 
 static struct {
-	u16 addr;	// write addr
-	u8* data;	// pointer to buffer
-	u8 len;		// buffer length
-	u8 n;		// index
+	struct nnk_eep_req* cur;	// request being written
+	struct nnk_eep_req* tail;	// last queued request
+	u8 n;				// index of the next byte to write
+
+	struct nnk_eep_req req;		// request of nnk_eep_write()
+
+	struct nnk_eep_stats stats;
 } eep;
 
 
@@ -48,27 +57,90 @@ static struct {
 // private fonctions
 //
 
+// end of the current request
+static void nnk_eep_done(void)
+{
+	struct nnk_eep_req* done = eep.cur;
+
+	// proceed to next request
+	eep.cur = done->next;
+	eep.n = 0;
+	if ( eep.cur == NULL )
+		eep.tail = NULL;
+
+	// signal it, a new request can be submitted meanwhile
+	done->busy = 0;
+	if ( done->call_back != NULL )
+		done->call_back(done->misc);
+}
+
+
+// the EEPROM is ready for the next byte
 ISR(EE_READY_vect)
 {
-	// one more byte written
-	// so proceed to next one
-	eep.n++;
-
-	// if there is still some place in the buffer
-	if ( eep.n < eep.len ) {
-		// write next byte
-		eep.addr++;
-		EEAR = eep.addr;
-		eep.data++;
-		EEDR = *eep.data;
+	struct nnk_eep_req* req;
+	u8 old;
+	u8 new;
+	u8 mode;
+	u8 steps;
+
+	// bound the time spent with the interrupts disabled
+	for ( steps = NNK_EEP_STEPS; steps; steps-- ) {
+		req = eep.cur;
+
+		// no more request
+		if ( req == NULL ) {
+			// disable eeprom interrupt
+			EECR &= ~_BV(EERIE);
+			return;
+		}
+
+		// every byte of the request is written
+		if ( eep.n >= req->len ) {
+			nnk_eep_done();
+			continue;
+		}
+
+		// read the stored byte
+		EEAR = req->addr + eep.n;
+		EECR |= _BV(EERE);
+		old = EEDR;
+		new = req->data[eep.n];
+		eep.n++;
+
+		// already the right value
+		if ( old == new ) {
+			eep.stats.skipped++;
+			continue;
+		}
+
+		// erase only when every bit is to be set
+		if ( new == 0xff ) {
+			mode = _BV(EEPM0);
+			eep.stats.erase_only++;
+		}
+		// write only when bits are only to be cleared
+		else if ( (old & new) == new ) {
+			mode = _BV(EEPM1);
+			eep.stats.write_only++;
+		}
+		// else atomic erase and write
+		else {
+			mode = 0;
+			eep.stats.erase_write++;
+		}
+
+		// write the byte
+		EECR = (EECR & ~(_BV(EEPM1) | _BV(EEPM0))) | mode;
+		EEDR = new;
 		EECR |= _BV(EEMPE);
 		EECR |= _BV(EEPE);
+
+		return;
 	}
-	// buffer is full
-	else {
-		// disable eeprom interrupt
-		EECR &= ~_BV(EERIE);
-	}
+
+	// the EEPROM being ready, the interrupt goes on at once
+	// with the next unchanged bytes
 }
 
 
@@ -80,8 +152,11 @@ ISR(EE_READY_vect)
 void nnk_eep_init(void)
 {
 	// reset internals
+	eep.cur = NULL;
+	eep.tail = NULL;
 	eep.n = 0;
-	eep.data = NULL;
+	eep.req.busy = 0;
+	nnk_eep_stats_reset();
 
 	// erase and write mode
 	EECR = 0;
@@ -92,9 +167,15 @@ void nnk_eep_init(void)
 u8 nnk_eep_read(u16 addr, u8* data, u8 len)
 {
 	u8 i;
+	u8 sreg;
+
+	sreg = SREG;
+	cli();
 
 	// if EEPROM is busy
-	if ( EECR & _BV(EEPE) ) {
+	if ( (EECR & _BV(EEPE)) || (eep.cur != NULL) ) {
+		SREG = sreg;
+
 		// it can't be read
 		return KO;
 	}
@@ -111,6 +192,8 @@ u8 nnk_eep_read(u16 addr, u8* data, u8 len)
 		*(data + i) = EEDR;
 	}
 
+	SREG = sreg;
+
 	return OK;
 }
 
@@ -118,37 +201,92 @@ u8 nnk_eep_read(u16 addr, u8* data, u8 len)
 // write len byte(s) to EEPROM address addr from data
 u8 nnk_eep_write(u16 addr, u8* data, u8 len)
 {
-	// if EEPROM is busy or a write is running
-	if ( (EECR & _BV(EEPE)) || (eep.data != NULL) ) {
+	// if the previous write is still queued
+	if ( eep.req.busy ) {
 		// it can't be written
 		return KO;
 	}
 
-	// save data buffer address and reset index
-	eep.addr = addr;
-	eep.data = data;
-	eep.len = len;
-	eep.n = 0;
+	eep.req.addr = addr;
+	eep.req.data = data;
+	eep.req.len = len;
+	eep.req.call_back = NULL;
 
-	// start first byte write
-	EEAR = addr;
-	EEDR = *data;
-	EECR |= _BV(EEMPE);
-	EECR |= _BV(EEPE);
+	return nnk_eep_submit(&eep.req);
+}
 
-	// enable eeprom interrupt
-	EECR |= _BV(EERIE);
 
-	return OK;
+u8 nnk_eep_is_fini(void)
+{
+	return nnk_eep_req_is_fini(&eep.req);
 }
 
-u8 nnk_eep_is_fini(void)
+
+// queue a write request
+u8 nnk_eep_submit(struct nnk_eep_req* req)
 {
-	// while writing
-	if ( eep.n < eep.len ) {
-		// it is not finished!!!!
+	u8 sreg;
+
+	// already queued or empty
+	if ( req->busy || (req->len == 0) )
 		return KO;
+
+	req->busy = 1;
+	req->next = NULL;
+
+	sreg = SREG;
+	cli();
+
+	// enqueue it
+	if ( eep.tail != NULL ) {
+		eep.tail->next = req;
 	}
+	// or start it
+	else {
+		eep.cur = req;
+		eep.n = 0;
+
+		// the ISR will write the bytes as soon as the EEPROM is ready
+		EECR |= _BV(EERIE);
+	}
+	eep.tail = req;
+
+	SREG = sreg;
 
 	return OK;
 }
+
+
+// check if the write request has ended
+u8 nnk_eep_req_is_fini(const struct nnk_eep_req* req)
+{
+	return req->busy ? KO : OK;
+}
+
+
+
+// get a copy of the programming counters
+void nnk_eep_stats_get(struct nnk_eep_stats* stats)
+{
+	u8 sreg = SREG;
+	cli();
+
+	*stats = eep.stats;
+
+	SREG = sreg;
+}
+
+
+// reset the programming counters
+void nnk_eep_stats_reset(void)
+{
+	u8 sreg = SREG;
+	cli();
+
+	eep.stats.skipped = 0;
+	eep.stats.erase_only = 0;
+	eep.stats.write_only = 0;
+	eep.stats.erase_write = 0;
+
+	SREG = sreg;
+}
@@ -25,16 +25,77 @@
 # include "type_def.h"
 
 
+// a write request
+//
+// the requests are queued and written one after the other by the EEPROM ISR,
+// so several writes can be outstanding without blocking the caller.
+//
+// each byte is read before being programmed:
+// - an unchanged byte is skipped,
+// - a byte only clearing bits is programmed in write only mode (1.8 ms),
+// - a byte set to 0xff is programmed in erase only mode (1.8 ms),
+// - else it is programmed in erase and write mode (3.4 ms).
+// so a rewrite of mostly unchanged data is fast and barely wears the cells.
+// the descriptor and its buffer belong to the caller
+// and shall remain allocated till the end of the write.
+// the descriptor shall be zeroed (static or = { 0 }) before its first submit,
+// as its private busy flag tells if it is already queued.
+struct nnk_eep_req {
+	u16 addr;		// EEPROM address
+	const u8* data;		// data to write
+	u8 len;			// number of bytes, not 0
+
+	// optional call-back called from ISR when the bytes are written
+	// a new request can be submitted from it.
+	void (*call_back)(void* misc);
+	void* misc;
+
+	// private
+	volatile u8 busy;
+	struct nnk_eep_req* next;
+};
+
+
+// programming counters
+struct nnk_eep_stats {
+	u16 skipped;		// unchanged bytes
+	u16 erase_only;		// bytes erased to 0xff
+	u16 write_only;		// bytes with bits only cleared
+	u16 erase_write;	// bytes erased then written
+};
+
+
 // EEPROM driver initialization
 extern void nnk_eep_init(void);
 
 // read len byte(s) from EEPROM address addr and copy them in data
+// it fails while a write is running
 extern u8 nnk_eep_read(u16 addr, u8* data, u8 len);
 
 // write len byte(s) to EEPROM address addr from data
+// it is queued with the other write requests
+// it fails if the previous call is still queued
 extern u8 nnk_eep_write(u16 addr, u8* data, u8 len);
 
-// check if eeprom write has ended
+// check if the write of nnk_eep_write() has ended
 extern u8 nnk_eep_is_fini(void);
 
+// queue a write request
+// if the request is already queued or empty, it returns KO else OK
+extern u8 nnk_eep_submit(struct nnk_eep_req* req);
+
+// check if the write request has ended
+extern u8 nnk_eep_req_is_fini(const struct nnk_eep_req* req);
+
+// get a copy of the programming counters
+extern void nnk_eep_stats_get(struct nnk_eep_stats* stats);
+
+// reset the programming counters
+extern void nnk_eep_stats_reset(void);
+
+# ifdef __PT_H__
+#  define PT_EEP_WAIT(pt, req)				\
+	PT_WAIT_UNTIL((pt), nnk_eep_req_is_fini(req))
+# endif	// __PT_H__
+
 #endif	// __EEPROM_H__
@@ -0,0 +1,513 @@
+#include "drivers/mspim.h"
+#include "drivers/sleep.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>	// ISR()
+
+#ifdef NNK_MSPIM_USART
+
+//-------------------------------------------
+// private defines
+//
+
+// registers of the chosen USART
+#define NNK_MSPIM_CAT(a, n, b)	a ## n ## b
+#define NNK_MSPIM_REG(a, n, b)	NNK_MSPIM_CAT(a, n, b)
+
+#define UCSRA	NNK_MSPIM_REG(UCSR, NNK_MSPIM_USART, A)
+#define UCSRB	NNK_MSPIM_REG(UCSR, NNK_MSPIM_USART, B)
+#define UCSRC	NNK_MSPIM_REG(UCSR, NNK_MSPIM_USART, C)
+#define UBRR	NNK_MSPIM_REG(UBRR, NNK_MSPIM_USART, )
+#define UDR	NNK_MSPIM_REG(UDR, NNK_MSPIM_USART, )
+
+// USART0 vector is not numbered on single USART MCUs
+#if (NNK_MSPIM_USART == 0) && !defined(USART0_RX_vect)
+# define NNK_MSPIM_RX_vect	USART_RX_vect
+#else
+# define NNK_MSPIM_RX_vect	NNK_MSPIM_REG(USART, NNK_MSPIM_USART, _RX_vect)
+#endif
+
+// XCK pin of the chosen USART
+#if defined(__AVR_ATmega48__) || defined(__AVR_ATmega88__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__)
+# define NNK_MSPIM_XCK_DDR	DDRD
+# define NNK_MSPIM_XCK		PD4
+#elif NNK_MSPIM_USART == 0	// ATmega164/324/644/1284
+# define NNK_MSPIM_XCK_DDR	DDRB
+# define NNK_MSPIM_XCK		PB0
+#else
+# define NNK_MSPIM_XCK_DDR	DDRD
+# define NNK_MSPIM_XCK		PD4
+#endif
+
+// statistics update
+#if NNK_SPI_STATS
+# define NNK_MSPIM_STAT_INC(field)	mspim.stats.field++
+#else
+# define NNK_MSPIM_STAT_INC(field)	do {} while (0)
+#endif
+
+
+//-------------------------------------------
+// private variables
+//
+
+static struct {
+	volatile u8 fini:1;	// flag to be used in blocking mode
+	u8 error:1;		// transfert on error
+	u8 held:1;		// the sleep is limited by the running transfer
+
+	volatile enum nnk_spi_state state;
+
+	// current clock divisor
+	enum nnk_spi_clock_div clock_div;
+
+	// transmission position
+	const struct nnk_spi_seg* tx_seg;
+	u8 tx_nb;		// segments left including the current one
+	u8 tx_idx;
+
+	// reception position
+	const struct nnk_spi_seg* rx_seg;
+	u8 rx_nb;		// segments left including the current one
+	u8 rx_idx;
+
+	u8 in_flight;		// bytes sent but not yet received
+
+	// segments of nnk_mspim_master()
+	struct nnk_spi_seg segs[2];
+
+	// chip select handling
+	const struct nnk_spi_cs* cs;
+	u8 cs_keep:1;		// keep it asserted at end of transfer
+	u8 cs_active:1;		// currently asserted
+
+	// call-back
+	void (*call_back)(enum nnk_spi_state st, void* misc);
+	void* misc;
+
+#if NNK_SPI_STATS
+	// stats
+	struct nnk_spi_stats stats;
+	u16 (*clock)(void);	// to measure the ISR duration
+#endif
+} mspim;
+
+
+//-------------------------------------------
+// private functions
+//
+
+static void nnk_mspim_cs_assert(void)
+{
+	const struct nnk_spi_cs* cs = mspim.cs;
+
+	if ( (cs == NULL) || mspim.cs_active )
+		return;
+
+	if ( cs->active_high )
+		*cs->port |= _BV(cs->pin);
+	else
+		*cs->port &= ~_BV(cs->pin);
+
+	mspim.cs_active = 1;
+}
+
+
+static void nnk_mspim_cs_deassert(void)
+{
+	const struct nnk_spi_cs* cs = mspim.cs;
+
+	if ( (cs == NULL) || !mspim.cs_active )
+		return;
+
+	if ( cs->active_high )
+		*cs->port &= ~_BV(cs->pin);
+	else
+		*cs->port |= _BV(cs->pin);
+
+	mspim.cs_active = 0;
+}
+
+
+// queue the next byte to send
+static inline void nnk_mspim_tx(void)
+{
+	const struct nnk_spi_seg* seg = mspim.tx_seg;
+
+	UDR = ( seg->tx != NULL ) ? seg->tx[mspim.tx_idx] : 0xff;
+	mspim.in_flight++;
+
+	// at end of segment, go to the next non empty one
+	mspim.tx_idx++;
+	if ( mspim.tx_idx >= seg->len ) {
+		mspim.tx_idx = 0;
+		do {
+			mspim.tx_seg++;
+			mspim.tx_nb--;
+		} while ( mspim.tx_nb && (mspim.tx_seg->len == 0) );
+	}
+}
+
+
+// store the received byte
+static inline void nnk_mspim_rx(void)
+{
+	const struct nnk_spi_seg* seg = mspim.rx_seg;
+	u8 data = UDR;
+
+	if ( seg->rx != NULL )
+		seg->rx[mspim.rx_idx] = data;
+	mspim.in_flight--;
+	NNK_MSPIM_STAT_INC(bytes);
+
+	// at end of segment, go to the next non empty one
+	mspim.rx_idx++;
+	if ( mspim.rx_idx >= seg->len ) {
+		mspim.rx_idx = 0;
+		do {
+			mspim.rx_seg++;
+			mspim.rx_nb--;
+		} while ( mspim.rx_nb && (mspim.rx_seg->len == 0) );
+	}
+}
+
+
+// leave the running state
+// releasing the sleep limit of an interrupt driven transfer whatever its end
+static void nnk_mspim_idle(void)
+{
+	mspim.state = NNK_SPI_IDLE;
+
+	if ( mspim.held ) {
+		mspim.held = 0;
+		nnk_slp_io_release();
+	}
+}
+
+
+// end of transfer
+static void nnk_mspim_end(void)
+{
+	// no more reception interrupt
+	UCSRB &= ~_BV(RXCIE0);
+
+	// unselect slave unless a chained transfer follows
+	if ( !mspim.cs_keep )
+		nnk_mspim_cs_deassert();
+
+	nnk_mspim_idle();
+	NNK_MSPIM_STAT_INC(transfers);
+
+	// signal end of transmission
+	// a new transfer can be started from the call-back
+	mspim.call_back(NNK_SPI_MASTER_END, mspim.misc);
+}
+
+
+// a byte is received, so the transmitter has room for the next one
+ISR(NNK_MSPIM_RX_vect)
+{
+#if NNK_SPI_STATS
+	u16 (*clock)(void) = mspim.clock;
+	u16 start = 0;
+	u16 duration;
+
+	if ( clock != NULL )
+		start = clock();
+#endif
+
+	nnk_mspim_rx();
+
+	// keep two bytes in flight so the bus never idles
+	if ( mspim.tx_nb )
+		nnk_mspim_tx();
+
+	if ( mspim.rx_nb == 0 )
+		nnk_mspim_end();
+
+#if NNK_SPI_STATS
+	if ( clock != NULL ) {
+		duration = clock() - start;
+		if ( duration > mspim.stats.isr_max )
+			mspim.stats.isr_max = duration;
+	}
+#endif
+}
+
+
+// default call-back only useful for blocking mode
+static void nnk_mspim_default_call_back(enum nnk_spi_state st, void* misc)
+{
+	(void)misc;
+
+	mspim.error = ( st == NNK_SPI_ERROR ) ? 1 : 0;
+	mspim.fini = OK;
+}
+
+
+//-------------------------------------------
+// public functions
+//
+
+void nnk_mspim_init(enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div)
+{
+	u8 ucsrc = _BV(UMSEL01) | _BV(UMSEL00);
+
+	// stop the USART
+	UCSRB = 0;
+	UBRR = 0;
+
+	// XCK as output makes the USART master
+	NNK_MSPIM_XCK_DDR |= _BV(NNK_MSPIM_XCK);
+
+	switch ( mode ) {
+	case NNK_SPI_ZERO:	// CPOL = 0 and CPHA = 0
+	default:
+		break;
+
+	case NNK_SPI_ONE:	// CPOL = 0 and CPHA = 1
+		ucsrc |= _BV(UCPHA0);
+		break;
+
+	case NNK_SPI_TWO:	// CPOL = 1 and CPHA = 0
+		ucsrc |= _BV(UCPOL0);
+		break;
+
+	case NNK_SPI_THREE:	// CPOL = 1 and CPHA = 1
+		ucsrc |= _BV(UCPOL0);
+		ucsrc |= _BV(UCPHA0);
+		break;
+	}
+
+	if ( data_order == NNK_SPI_LSB )
+		ucsrc |= _BV(UDORD0);
+
+	UCSRC = ucsrc;
+
+	// enable transmitter and receiver
+	UCSRB = _BV(RXEN0) | _BV(TXEN0);
+
+	// baud rate shall be set after the transmitter is enabled
+	nnk_mspim_set_clock(clock_div);
+
+	// reset internals
+	nnk_mspim_idle();
+	mspim.cs = NULL;
+	mspim.cs_active = 0;
+	mspim.call_back = nnk_mspim_default_call_back;
+	mspim.misc = NULL;
+	nnk_mspim_stats_reset();
+}
+
+
+// set the MSPIM clock speed
+void nnk_mspim_set_clock(enum nnk_spi_clock_div clock_div)
+{
+	if ( clock_div > NNK_SPI_DIV_128 )
+		return;
+
+	// fsck = F_CPU / (2 * (UBRR + 1))
+	UBRR = (1 << clock_div) - 1;
+	mspim.clock_div = clock_div;
+}
+
+
+// set the chip select of the next transfers
+u8 nnk_mspim_cs_set(const struct nnk_spi_cs* cs, u8 keep)
+{
+	if ( mspim.state != NNK_SPI_IDLE )
+		return KO;
+
+	// release a previous chip select still asserted
+	if ( cs != mspim.cs )
+		nnk_mspim_cs_deassert();
+
+	mspim.cs = cs;
+	mspim.cs_keep = keep ? 1 : 0;
+
+	return OK;
+}
+
+
+// release a chip select kept asserted
+u8 nnk_mspim_cs_release(void)
+{
+	if ( mspim.state != NNK_SPI_IDLE )
+		return KO;
+
+	nnk_mspim_cs_deassert();
+
+	return OK;
+}
+
+
+// call-back init
+void nnk_mspim_call_back_set(void (*call_back)(enum nnk_spi_state st, void* misc), void* misc)
+{
+	mspim.call_back = call_back;
+	mspim.misc = misc;
+}
+
+
+// handle a transmission
+u8 nnk_mspim_master(const u8* const tx_buf, u8 tx_len, u8* const rx_buf, u8 rx_len)
+{
+	u8 n;
+
+	if ( mspim.state != NNK_SPI_IDLE )
+		return KO;
+
+	// full duplex part
+	n = ( tx_len < rx_len ) ? tx_len : rx_len;
+	mspim.segs[0].tx = tx_buf;
+	mspim.segs[0].rx = rx_buf;
+	mspim.segs[0].len = n;
+
+	// then either tx or rx only part
+	mspim.segs[1].tx = ( tx_len > n ) ? tx_buf + n : NULL;
+	mspim.segs[1].rx = ( rx_len > n ) ? rx_buf + n : NULL;
+	mspim.segs[1].len = ( tx_len > n ) ? tx_len - n : rx_len - n;
+
+	return nnk_mspim_master_sg(mspim.segs, 2);
+}
+
+
+// handle a scatter-gather transmission
+u8 nnk_mspim_master_sg(const struct nnk_spi_seg* segs, u8 nb)
+{
+	u8 i;
+	u16 len = 0;
+
+	if ( mspim.state != NNK_SPI_IDLE )
+		return KO;
+
+	// skip leading empty segments and compute total length
+	while ( nb && (segs->len == 0) ) {
+		segs++;
+		nb--;
+	}
+	for ( i = 0; i < nb; i++ )
+		len += segs[i].len;
+
+	// nothing to transfer
+	if ( len == 0 )
+		return KO;
+
+	// save contexts
+	mspim.tx_seg = segs;
+	mspim.tx_nb = nb;
+	mspim.tx_idx = 0;
+	mspim.rx_seg = segs;
+	mspim.rx_nb = nb;
+	mspim.rx_idx = 0;
+	mspim.in_flight = 0;
+
+	// set the flag to detect end of transmission
+	mspim.fini = KO;
+
+	// flush the receiver
+	while ( UCSRA & _BV(RXC0) )
+		(void)UDR;
+
+	mspim.state = NNK_SPI_RUNNING;
+	nnk_mspim_cs_assert();	// select slave
+
+	// short or fast transfer, the ISR would cost more than the bytes
+	if ( (len <= NNK_SPI_POLL_LEN) || ((mspim.clock_div <= NNK_SPI_POLL_DIV) && (len <= NNK_SPI_POLL_MAX)) ) {
+		while ( mspim.rx_nb ) {
+			// keep the transmitter fed
+			if ( mspim.tx_nb && (mspim.in_flight < 2) && (UCSRA & _BV(UDRE0)) )
+				nnk_mspim_tx();
+
+			if ( UCSRA & _BV(RXC0) )
+				nnk_mspim_rx();
+		}
+
+		// unselect slave unless a chained transfer follows
+		if ( !mspim.cs_keep )
+			nnk_mspim_cs_deassert();
+
+		nnk_mspim_idle();
+		NNK_MSPIM_STAT_INC(transfers);
+
+		// signal end of transmission from the caller context
+		mspim.call_back(NNK_SPI_MASTER_END, mspim.misc);
+
+		return OK;
+	}
+
+	// fill both transmit buffers, the ISR will do the rest of the job
+	nnk_mspim_tx();
+	if ( mspim.tx_nb )
+		nnk_mspim_tx();
+	mspim.held = 1;
+	nnk_slp_io_hold();
+	UCSRB |= _BV(RXCIE0);
+
+	return OK;
+}
+
+
+// when using the default call-back, call this function to know if the transfert is done
+u8 nnk_mspim_is_fini(void)
+{
+	return mspim.fini;
+}
+
+
+// when using the default call-back, call this function to know if the transfert is OK
+u8 nnk_mspim_is_ok(void)
+{
+	return mspim.error ? KO : OK;
+}
+
+
+// get a copy of the counters
+void nnk_mspim_stats_get(struct nnk_spi_stats* stats)
+{
+#if NNK_SPI_STATS
+	u8 sreg = SREG;
+	cli();
+
+	*stats = mspim.stats;
+
+	SREG = sreg;
+#else
+	stats->bytes = 0;
+	stats->transfers = 0;
+	stats->errors = 0;
+	stats->spurious = 0;
+	stats->isr_max = 0;
+#endif
+}
+
+
+// reset the counters
+void nnk_mspim_stats_reset(void)
+{
+#if NNK_SPI_STATS
+	u8 sreg = SREG;
+	cli();
+
+	mspim.stats.bytes = 0;
+	mspim.stats.transfers = 0;
+	mspim.stats.errors = 0;
+	mspim.stats.spurious = 0;
+	mspim.stats.isr_max = 0;
+
+	SREG = sreg;
+#endif
+}
+
+
+// set the clock used to measure the ISR duration
+void nnk_mspim_stats_clock_set(u16 (*clock)(void))
+{
+#if NNK_SPI_STATS
+	mspim.clock = clock;
+#else
+	(void)clock;
+#endif
+}
+
+#endif	// NNK_MSPIM_USART
@@ -0,0 +1,76 @@
+#ifndef __NNK_MSPIM_H__
+#define __NNK_MSPIM_H__
+
+# include "type_def.h"
+# include "drivers/spi.h"
+
+//
+// USART in SPI master mode (MSPIM)
+//
+// it provides a second SPI master port with the same API as drivers/spi.c.
+// the USART transmitter is double buffered, so the next byte is queued
+// while the current one is shifted and the bytes go out back-to-back,
+// without the gap imposed by the single buffered SPDR.
+//
+// the USART is chosen at compile time with NNK_MSPIM_USART (0, 1, ...)
+// and is then no longer handled by drivers/rs.c.
+// on the ATmega328P, the only USART is USART0: using the MSPIM
+// takes it from drivers/rs.c, so the console (stdin, stdout) is lost.
+// if NNK_MSPIM_USART is not defined, the driver is not built.
+//
+// throughput @ 8 MHz, estimated from the loops cycle counts (not measured):
+//   divisor |  bus rate  |   SPI polled   |  MSPIM polled
+//  ---------+------------+----------------+---------------
+//      2    |  500 kB/s  |   ~320 kB/s    |   ~400 kB/s
+//      4    |  250 kB/s  |   ~200 kB/s    |   ~250 kB/s
+//      8    |  125 kB/s  |   ~115 kB/s    |   ~125 kB/s
+// with the interrupt driven path, the MSPIM keeps the bus busy
+// as long as the ISR is shorter than one byte on the bus (divisor 8 and more).
+//
+// the MSPIM only supports the master behaviour.
+// the XCK pin of the USART is used as SCK, TXD as MOSI and RXD as MISO.
+//
+
+//-------------------------------------------
+// public functions
+//
+
+// set the mode, the data order and the clock of the MSPIM
+extern void nnk_mspim_init(enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div);
+
+// set the MSPIM clock speed
+extern void nnk_mspim_set_clock(enum nnk_spi_clock_div clock_div);
+
+// set the chip select used by the next transfers (NULL for none, default)
+// see nnk_spi_cs_set() for details
+extern u8 nnk_mspim_cs_set(const struct nnk_spi_cs* cs, u8 keep);
+
+// release a chip select kept asserted
+extern u8 nnk_mspim_cs_release(void);
+
+// set a call-back function and an optional parameter
+extern void nnk_mspim_call_back_set(void (*call_back)(enum nnk_spi_state st, void* misc), void* misc);
+
+// transmit and receive data
+// the buffers shall be remained allocated till the end of the transfer
+// short transfers are polled (see NNK_SPI_POLL_LEN and NNK_SPI_POLL_MAX)
+extern u8 nnk_mspim_master(const u8* const tx_buf, u8 tx_len, u8* const rx_buf, u8 rx_len);
+
+// transmit and receive a list of segments in a single transfer
+extern u8 nnk_mspim_master_sg(const struct nnk_spi_seg* segs, u8 nb);
+
+// when using the default call-back, call this function to know if the transfert is done
+extern u8 nnk_mspim_is_fini(void);
+
+// when using the default call-back, call this function to know if the transfert is OK
+// it returns OK if the last transfer succeeded, KO on error
+extern u8 nnk_mspim_is_ok(void);
+
+// statistics, see nnk_spi_stats_get() for details
+extern void nnk_mspim_stats_get(struct nnk_spi_stats* stats);
+
+extern void nnk_mspim_stats_reset(void);
+
+extern void nnk_mspim_stats_clock_set(u16 (*clock)(void));
+
+#endif	// __NNK_MSPIM_H__
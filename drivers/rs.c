@@ -22,38 +22,80 @@
 #include "drivers/rs.h"
 
 #include <stdio.h>		// printf() and associated functions
+#include <string.h>		// memmove()
 #include <avr/io.h>		// UBRRH, UBBRL, UCSR?
 #include <avr/interrupt.h>	// ISR()
 
 #include "utils/fifo.h"
+#include "utils/time.h"
+
+#include "drivers/mspim.h"	// NNK_MSPIM_USART
 
 //static const u8 dec2hex[] PROGMEM = "0123456789abcdef";
 
 //------------------------------
-// private variables
+// private defines
 //
 
-#define FP_BUF_LEN	10
+// number of USARTs of the MCU
+#if defined(UCSR3A)
+# define NNK_RS_NB	4
+#elif defined(UCSR2A)
+# define NNK_RS_NB	3
+#elif defined(UCSR1A)
+# define NNK_RS_NB	2
+#else
+# define NNK_RS_NB	1
+#endif
+
+// USART0 vectors are not numbered on single USART MCUs
+#ifndef USART0_RX_vect
+# define USART0_RX_vect		USART_RX_vect
+# define USART0_UDRE_vect	USART_UDRE_vect
+#endif
+
+// the USART used as SPI master is handled by drivers/mspim.c
+#ifndef NNK_MSPIM_USART
+# define NNK_MSPIM_USART	0xff
+#endif
+
+// every USART has the same registers layout
+// so they are accessed from UCSRnA address
+#define UCSRA	0
+#define UCSRB	1
+#define UCSRC	2
+#define UBRRL	4
+#define UBRRH	5
+#define UDR	6
+
+
+//------------------------------
+// private variables
+//
 
+// USART registers base
+static volatile u8* const nnk_rs_regs[NNK_RS_NB] = {
+	&UCSR0A,
+#if NNK_RS_NB > 1
+	&UCSR1A,
+#endif
+#if NNK_RS_NB > 2
+	&UCSR2A,
+#endif
+#if NNK_RS_NB > 3
+	&UCSR3A,
+#endif
+};
+
+// opened instances
+static struct nnk_rs* nnk_rs_dev[NNK_RS_NB];
+
+// instance of USART0 bound to stdout and its buffers
 static struct {
-	FILE file;
+	struct nnk_rs rs;
 
-	// fifoes and their associated buffers
 	u8 rx_buf[RS_RX_LEN];
-	struct nnk_fifo rx_fifo;
 	u8 tx_buf[RS_TX_LEN];
-	struct nnk_fifo tx_fifo;
-
-	// buffer for floating point operations
-	u8 fp_buf[FP_BUF_LEN];
-
-	// hardware failures
-	u8 FE_cnt;			// Frame Error counter
-	u8 DOR_cnt;			// Data OverRun counter
-	u8 PE_cnt;			// Parity Error counter
-
-	// fifo failures
-	u8 rx_ovfl_cnt;
 } RS;
 
 
@@ -61,74 +103,264 @@ static struct {
 // private fonctions
 //
 
-ISR(USART_RX_vect)
+// count dropped characters
+// the count is also updated from the ISRs logging through nnk_rs_put_buf()
+static void nnk_rs_tx_drop(struct nnk_rs* rs, u16 nb)
 {
+	u8 sreg = SREG;
+	cli();
+
+	rs->tx_drop_cnt += nb;
+
+	SREG = sreg;
+}
+
+
+// store a received byte either in the bulk read buffer or in the rx fifo
+static void nnk_rs_rx_store(struct nnk_rs* rs, u8 data)
+{
+	void (*done)(void* misc);
+
+	// a hook handles the bytes on the fly
+	if ( rs->rx_hook != NULL ) {
+		rs->rx_hook(data, rs->rx_hook_misc);
+		return;
+	}
+
+	// idle line packetisation
+	if ( rs->idle_buf != NULL ) {
+		rs->idle_last = nnk_time_get();
+
+		// no room left, the previous frame being handed over included
+		if ( rs->idle_idx >= rs->idle_len ) {
+			rs->rx_ovfl_cnt++;
+			return;
+		}
+
+		rs->idle_buf[rs->idle_idx] = data;
+		rs->idle_idx++;
+		return;
+	}
+
+	// if no bulk read is pending, use the fifo
+	if ( rs->rd_buf == NULL ) {
+		if (nnk_fifo_put(&rs->rx_fifo, &data) == KO)	// put rxed char in fifo
+			rs->rx_ovfl_cnt++;		// on error, inc counter
+		return;
+	}
+
+	rs->rd_buf[rs->rd_idx] = data;
+	rs->rd_idx++;
+
+	// caller buffer is full
+	if ( rs->rd_idx >= rs->rd_len ) {
+		// release it before signaling so a new read can be chained from the call-back
+		rs->rd_buf = NULL;
+		done = rs->rd_done;
+		if ( done != NULL )
+			done(rs->rd_misc);
+	}
+}
+
+
+static inline void nnk_rs_rx_isr(struct nnk_rs* rs)
+{
+	volatile u8* regs = rs->regs;
 	u8 buf;
 
 	// check for Frame Error
-	if ( UCSR0A & _BV(FE0) ) {
-		RS.FE_cnt++;
+	if ( regs[UCSRA] & _BV(FE0) ) {
+		rs->FE_cnt++;
 
-		buf = UDR0;		// received data read but unused
+		buf = regs[UDR];	// received data read but unused
 
 		return;
 	}
 
 	// check for Data OverRun
-	if ( UCSR0A & _BV(DOR0) ) {
-		RS.DOR_cnt++;
+	if ( regs[UCSRA] & _BV(DOR0) ) {
+		rs->DOR_cnt++;
 
-		buf = UDR0;
-		if (nnk_fifo_put(&RS.rx_fifo, &buf) == KO)	// put rxed char in fifo
-			RS.rx_ovfl_cnt++;		// on error, inc counter
+		buf = regs[UDR];
+		nnk_rs_rx_store(rs, buf);
 	}
 
 	// check for Parity Error
-	if ( UCSR0A & _BV(UPE0) ) {
-		RS.PE_cnt++;
+	if ( regs[UCSRA] & _BV(UPE0) ) {
+		rs->PE_cnt++;
 
-		buf = UDR0;		// received data read but unused
+		buf = regs[UDR];	// received data read but unused
 
 		return;
 	}
 
-	buf = UDR0;
-	if (nnk_fifo_put(&RS.rx_fifo, &buf) == KO)	// put rxed char in fifo
-		RS.rx_ovfl_cnt++;		// on error, inc counter
+	buf = regs[UDR];
+	nnk_rs_rx_store(rs, buf);
 }
 
 
-ISR(USART_UDRE_vect)
+static inline void nnk_rs_udre_isr(struct nnk_rs* rs)
 {
+	volatile u8* regs = rs->regs;
 	u8 buf;
+	void (*done)(void* misc);
+
+	// if a bulk write is pending and every fifo byte queued before it is sent
+	if ( (rs->wr_buf != NULL) && (rs->wr_ahead == 0) ) {
+		// send straight from the caller buffer
+		regs[UDR] = rs->wr_buf[rs->wr_idx];
+		rs->wr_idx++;
+
+		// end of caller buffer
+		if ( rs->wr_idx >= rs->wr_len ) {
+			// release it before signaling so a new write can be chained from the call-back
+			rs->wr_buf = NULL;
+			done = rs->wr_done;
+			if ( done != NULL )
+				done(rs->wr_misc);
+		}
+
+		return;
+	}
+
+	if ( nnk_fifo_get(&rs->tx_fifo, &buf) == OK) {
+		regs[UDR] = buf;	// get a char from fifo is available
 
-	if ( nnk_fifo_get(&RS.tx_fifo, &buf) == OK)
-		UDR0 = buf;		// get a char from fifo is available
+		// one less byte ahead of the bulk write
+		if ( rs->wr_ahead )
+			rs->wr_ahead--;
+	}
 	else
-		UCSR0B &= ~_BV(UDRIE0);	// no more data to send, stop Tx interrupt
+		regs[UCSRB] &= ~_BV(UDRIE0);	// no more data to send, stop Tx interrupt
+}
+
+
+#if NNK_MSPIM_USART != 0
+ISR(USART0_RX_vect)
+{
+	nnk_rs_rx_isr(nnk_rs_dev[0]);
+}
+
+
+ISR(USART0_UDRE_vect)
+{
+	nnk_rs_udre_isr(nnk_rs_dev[0]);
 }
+#endif
+
+
+#if (NNK_RS_NB > 1) && (NNK_MSPIM_USART != 1)
+ISR(USART1_RX_vect)
+{
+	nnk_rs_rx_isr(nnk_rs_dev[1]);
+}
+
+
+ISR(USART1_UDRE_vect)
+{
+	nnk_rs_udre_isr(nnk_rs_dev[1]);
+}
+#endif
+
+
+#if (NNK_RS_NB > 2) && (NNK_MSPIM_USART != 2)
+ISR(USART2_RX_vect)
+{
+	nnk_rs_rx_isr(nnk_rs_dev[2]);
+}
+
+
+ISR(USART2_UDRE_vect)
+{
+	nnk_rs_udre_isr(nnk_rs_dev[2]);
+}
+#endif
+
+
+#if (NNK_RS_NB > 3) && (NNK_MSPIM_USART != 3)
+ISR(USART3_RX_vect)
+{
+	nnk_rs_rx_isr(nnk_rs_dev[3]);
+}
+
+
+ISR(USART3_UDRE_vect)
+{
+	nnk_rs_udre_isr(nnk_rs_dev[3]);
+}
+#endif
 
 
 // write one byte
 static int nnk_rs_put(char data, FILE* f)
 {
-	(void)f;
+	struct nnk_rs* rs = fdev_get_udata(f);
+	u8 sreg;
+	u8 buf;
 
-	// if there is some empty space in the Tx fifo
-	if ( nnk_fifo_free(&RS.tx_fifo) ) {
-		// add the new character to the Tx fifo
-		nnk_fifo_put(&RS.tx_fifo, &data);
+	// while truncating a line, drop everything till its end
+	if ( rs->tx_truncating ) {
+		if ( (data != '\n') || (nnk_fifo_put(&rs->tx_fifo, &data) != OK) ) {
+			nnk_rs_tx_drop(rs, 1);
+			return 0;
+		}
 
-		// (re-)enable UDRE interrupt
-		UCSR0B |= _BV(UDRIE0);
+		// end of line queued, back to normal
+		rs->tx_truncating = 0;
+		rs->regs[UCSRB] |= _BV(UDRIE0);
+
+		return 0;
 	}
-	else {
+
+	// if there is some empty space in the Tx fifo
+	if ( nnk_fifo_put(&rs->tx_fifo, &data) == OK ) {
 		// (re-)enable UDRE interrupt
-		UCSR0B |= _BV(UDRIE0);
+		rs->regs[UCSRB] |= _BV(UDRIE0);
+
+		return 0;
+	}
+
+	// (re-)enable UDRE interrupt
+	rs->regs[UCSRB] |= _BV(UDRIE0);
+
+	switch ( rs->tx_policy ) {
+	case NNK_RS_TX_DROP_NEWEST:
+		nnk_rs_tx_drop(rs, 1);
+		break;
+
+	case NNK_RS_TX_DROP_OLDEST:
+		sreg = SREG;
+		cli();
 
-		// and block as long as there is no empty space in the Tx fifo
-		while ( nnk_fifo_put(&RS.tx_fifo, &data) != OK ) {
+		// make room by discarding the oldest character
+		if ( nnk_fifo_get(&rs->tx_fifo, &buf) == OK ) {
+			rs->tx_drop_cnt++;
+
+			// it may have been queued before the bulk write
+			if ( rs->wr_ahead )
+				rs->wr_ahead--;
+		}
+
+		if ( nnk_fifo_put(&rs->tx_fifo, &data) != OK )
+			rs->tx_drop_cnt++;
+
+		SREG = sreg;
+		break;
+
+	case NNK_RS_TX_DROP_LINE:
+		nnk_rs_tx_drop(rs, 1);
+
+		// drop the rest of the line unless it is already over
+		if ( data != '\n' )
+			rs->tx_truncating = 1;
+		break;
+
+	case NNK_RS_TX_BLOCK:
+	default:
+		// block as long as there is no empty space in the Tx fifo
+		while ( nnk_fifo_put(&rs->tx_fifo, &data) != OK ) {
 		}
+		break;
 	}
 
 	return 0;
@@ -138,12 +370,11 @@ static int nnk_rs_put(char data, FILE* f)
 // read one byte
 static int nnk_rs_get(FILE* f)
 {
+	struct nnk_rs* rs = fdev_get_udata(f);
 	u8 buf;
 
-	(void)f;
-
 	// if no character in fifo, 
-	if ( nnk_fifo_get(&(RS.rx_fifo), &buf) != OK )
+	if ( nnk_fifo_get(&rs->rx_fifo, &buf) != OK )
 		return _FDEV_EOF;	// return End Of File
 	else
 		return (int)buf;	// return read data
@@ -154,39 +385,283 @@ static int nnk_rs_get(FILE* f)
 // public fonctions
 //
 
-// setup of the USART
-void nnk_rs_init(u8 baud)
+// setup of the USART0 bound to stdin and stdout
+void nnk_rs_init(u16 baud)
 {
-	// set transmission speed
-	UBRR0H = 0;
-	UBRR0L = baud;
+	if ( nnk_rs_open(&RS.rs, NNK_RS_USART0, baud, RS.rx_buf, RS_RX_LEN, RS.tx_buf, RS_TX_LEN) == KO )
+		return;
 
-	// enable interrupt on Rx, Rx and Tx
-	UCSR0B = _BV(RXCIE0) | _BV(TXEN0) | _BV(RXEN0);
+	// manually assign standard streams 
+	stdout = &RS.rs.file;
+	stdin = &RS.rs.file;
+}
 
-	// 8N1
-	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+// return the values of Frame Error, Data OverRun and Parity Error counters
+void nnk_rs_cnt(u8* FE_cnt,	u8* DOR_cnt, u8* PE_cnt, u8* rx_ovfl_cnt)
+{
+	nnk_rs_dev_cnt(&RS.rs, FE_cnt, DOR_cnt, PE_cnt, rx_ovfl_cnt);
+}
+
+
+// return the USART0 instance bound to stdin and stdout
+struct nnk_rs* nnk_rs_std(void)
+{
+	return &RS.rs;
+}
+
+
+// setup of any USART
+u8 nnk_rs_open(struct nnk_rs* rs, u8 usart, u16 baud, u8* rx_buf, u16 rx_len, u8* tx_buf, u16 tx_len)
+{
+	volatile u8* regs;
+
+	if ( (usart >= NNK_RS_NB) || (usart == NNK_MSPIM_USART) )
+		return KO;
+
+	regs = nnk_rs_regs[usart];
+	rs->regs = regs;
+
+	// stop the USART while (re-)configuring it
+	regs[UCSRB] = 0;
 
 	// fifoes init
-	nnk_fifo_init(&RS.rx_fifo, RS.rx_buf, RS_RX_LEN, sizeof(u8));
-	nnk_fifo_init(&RS.tx_fifo, RS.tx_buf, RS_TX_LEN, sizeof(u8));
+	nnk_fifo_init(&rs->rx_fifo, rx_buf, rx_len, sizeof(u8));
+	nnk_fifo_init(&rs->tx_fifo, tx_buf, tx_len, sizeof(u8));
+
+	// reset counters
+	rs->FE_cnt = 0;
+	rs->DOR_cnt = 0;
+	rs->PE_cnt = 0;
+	rs->rx_ovfl_cnt = 0;
+
+	// blocking fprintf by default
+	rs->tx_policy = NNK_RS_TX_BLOCK;
+	rs->tx_truncating = 0;
+	rs->tx_drop_cnt = 0;
+
+	// no hook, no packetisation and no bulk transfer
+	rs->rx_hook = NULL;
+	rs->idle_buf = NULL;
+	rs->wr_buf = NULL;
+	rs->rd_buf = NULL;
 
 	// create the file
-	fdev_setup_stream(&RS.file, nnk_rs_put, nnk_rs_get, _FDEV_SETUP_RW);
+	fdev_setup_stream(&rs->file, nnk_rs_put, nnk_rs_get, _FDEV_SETUP_RW);
+	fdev_set_udata(&rs->file, rs);
 	// manually add informations about floating point buffer
-	RS.file.buf = (char*) RS.fp_buf;
-	RS.file.size = FP_BUF_LEN;
+	rs->file.buf = (char*) rs->fp_buf;
+	rs->file.size = RS_FP_BUF_LEN;
 
-	// manually assign standard streams 
-	stdout = &RS.file;
-	stdin = &RS.file;
+	// the ISR can now find the instance
+	nnk_rs_dev[usart] = rs;
+
+	// set transmission speed
+	if ( baud & NNK_RS_U2X )
+		regs[UCSRA] |= _BV(U2X0);
+	else
+		regs[UCSRA] &= ~_BV(U2X0);
+	regs[UBRRH] = (baud >> 8) & 0x0f;
+	regs[UBRRL] = baud & 0xff;
+
+	// 8N1
+	regs[UCSRC] = _BV(UCSZ01) | _BV(UCSZ00);
+
+	// enable interrupt on Rx, Rx and Tx
+	regs[UCSRB] = _BV(RXCIE0) | _BV(TXEN0) | _BV(RXEN0);
+
+	return OK;
 }
 
-// return the values of Frame Error, Data OverRun and Parity Error counters
-void nnk_rs_cnt(u8* FE_cnt,	u8* DOR_cnt, u8* PE_cnt, u8* rx_ovfl_cnt)
+
+// return the values of the error counters of the instance
+void nnk_rs_dev_cnt(struct nnk_rs* rs, u8* FE_cnt, u8* DOR_cnt, u8* PE_cnt, u8* rx_ovfl_cnt)
+{
+	*FE_cnt = rs->FE_cnt;
+	*DOR_cnt = rs->DOR_cnt;
+	*PE_cnt = rs->PE_cnt;
+	*rx_ovfl_cnt = rs->rx_ovfl_cnt;
+}
+
+
+// set the behaviour of fprintf() when the Tx fifo is full
+void nnk_rs_tx_policy_set(struct nnk_rs* rs, enum nnk_rs_tx_policy policy)
+{
+	rs->tx_policy = policy;
+	rs->tx_truncating = 0;
+}
+
+
+// return the number of characters dropped by the Tx policy
+u16 nnk_rs_tx_drop_cnt(struct nnk_rs* rs)
+{
+	u16 cnt;
+	u8 sreg = SREG;
+
+	cli();
+	cnt = rs->tx_drop_cnt;
+	SREG = sreg;
+
+	return cnt;
+}
+
+
+// set a hook called from the Rx ISR for each received byte
+void nnk_rs_rx_hook_set(struct nnk_rs* rs, void (*hook)(u8 data, void* misc), void* misc)
+{
+	u8 sreg = SREG;
+
+	cli();
+	rs->rx_hook = hook;
+	rs->rx_hook_misc = misc;
+	SREG = sreg;
+}
+
+
+// set the idle line packetisation
+void nnk_rs_idle_set(struct nnk_rs* rs, u8* buf, u8 len, u32 gap, void (*done)(const u8* data, u8 len, void* misc), void* misc)
+{
+	u8 sreg = SREG;
+
+	cli();
+	rs->idle_len = len;
+	rs->idle_idx = 0;
+	rs->idle_gap = gap;
+	rs->idle_done = done;
+	rs->idle_misc = misc;
+	rs->idle_buf = buf;
+	SREG = sreg;
+}
+
+
+// hand over the received frame if the line is silent for long enough
+void nnk_rs_idle_poll(struct nnk_rs* rs)
+{
+	u8 sreg;
+	u8 len = 0;
+
+	if ( rs->idle_buf == NULL )
+		return;
+
+	sreg = SREG;
+	cli();
+
+	// some bytes and silence since the last one
+	if ( rs->idle_idx && (nnk_time_get() - rs->idle_last >= rs->idle_gap) )
+		len = rs->idle_idx;
+
+	SREG = sreg;
+
+	if ( len == 0 )
+		return;
+
+	// the reception goes on in the rest of the buffer during the call-back
+	if ( rs->idle_done != NULL )
+		rs->idle_done(rs->idle_buf, len, rs->idle_misc);
+
+	// then the start of the next frame is moved at the begin of the buffer
+	// unless the packetisation was set again by done
+	sreg = SREG;
+	cli();
+	if ( rs->idle_idx >= len ) {
+		rs->idle_idx -= len;
+		memmove(rs->idle_buf, rs->idle_buf + len, rs->idle_idx);
+	}
+	SREG = sreg;
+}
+
+
+// transmit len bytes straight from buf after the already queued bytes
+u8 nnk_rs_write(struct nnk_rs* rs, const u8* buf, u8 len, void (*done)(void* misc), void* misc)
+{
+	u8 sreg;
+
+	// a bulk write is already running
+	if ( rs->wr_buf != NULL )
+		return KO;
+
+	// nothing to send
+	if ( len == 0 )
+		return KO;
+
+	sreg = SREG;
+	cli();
+
+	// save context
+	rs->wr_len = len;
+	rs->wr_idx = 0;
+	rs->wr_done = done;
+	rs->wr_misc = misc;
+
+	// bytes already in the fifo shall go out first
+	rs->wr_ahead = nnk_fifo_full(&rs->tx_fifo);
+	rs->wr_buf = buf;
+
+	// (re-)enable UDRE interrupt
+	rs->regs[UCSRB] |= _BV(UDRIE0);
+
+	SREG = sreg;
+
+	// now the ISR will do the rest of the job
+	return OK;
+}
+
+
+// queue len bytes in the tx fifo in one go
+u8 nnk_rs_put_buf(struct nnk_rs* rs, const u8* buf, u16 len)
+{
+	// not enough room
+	if ( nnk_fifo_put_buf(&rs->tx_fifo, buf, len) != OK ) {
+		nnk_rs_tx_drop(rs, len);
+		return KO;
+	}
+
+	// (re-)enable UDRE interrupt
+	rs->regs[UCSRB] |= _BV(UDRIE0);
+
+	return OK;
+}
+
+
+// receive len bytes straight into buf
+u8 nnk_rs_read_block(struct nnk_rs* rs, u8* buf, u8 len, void (*done)(void* misc), void* misc)
+{
+	u8 sreg;
+	u8 data;
+
+	// a bulk read is already running
+	if ( (rs->rd_buf != NULL) || (len == 0) )
+		return KO;
+
+	sreg = SREG;
+	cli();
+
+	// save context
+	rs->rd_len = len;
+	rs->rd_idx = 0;
+	rs->rd_done = done;
+	rs->rd_misc = misc;
+	rs->rd_buf = buf;
+
+	// bytes already in the fifo were received first
+	while ( (rs->rd_buf != NULL) && (nnk_fifo_get(&rs->rx_fifo, &data) == OK) )
+		nnk_rs_rx_store(rs, data);
+
+	SREG = sreg;
+
+	// now the ISR will do the rest of the job
+	return OK;
+}
+
+
+// check if the bulk write is finished
+u8 nnk_rs_write_is_fini(struct nnk_rs* rs)
+{
+	return (rs->wr_buf == NULL) ? OK : KO;
+}
+
+
+// check if the bulk read is finished
+u8 nnk_rs_read_is_fini(struct nnk_rs* rs)
 {
-	*FE_cnt = RS.FE_cnt;
-	*DOR_cnt = RS.DOR_cnt;
-	*PE_cnt = RS.PE_cnt;
-	*rx_ovfl_cnt = RS.rx_ovfl_cnt;
+	return (rs->rd_buf == NULL) ? OK : KO;
 }
@@ -27,40 +27,242 @@
 # include <stdio.h>	// that way, including rs.h will also bring printf() and associated prototypes
 
 # include "type_def.h"
+# include "utils/fifo.h"
 
-// Rx and Tx buffer lengths
-# define RS_RX_LEN	10
-# define RS_TX_LEN	70
-
-// baud rates for AVR @ 8 MHz
-#if 0	// a nice macro, should serve as an example for creating baud macroes
-# if F_CPU < 2000000UL && defined(U2X)
-	UCSRA = _BV(U2X);             /* improve baud rate error by using 2x clk */
-	UBRRL = (F_CPU / (8UL * UART_BAUD)) - 1;
-# else
-	UBRRL = (F_CPU / (16UL * UART_BAUD)) - 1;
+// Rx and Tx buffer lengths of the stdout USART
+// they can be overridden at compile time (-DRS_TX_LEN=256)
+// to get a larger staging ring for formatted output
+# ifndef RS_RX_LEN
+#  define RS_RX_LEN	10
 # endif
-#endif
+# ifndef RS_TX_LEN
+#  define RS_TX_LEN	70
+# endif
+
+// buffer for floating point operations
+# define RS_FP_BUF_LEN	10
+
+// available USARTs
+# define NNK_RS_USART0	0
+# define NNK_RS_USART1	1
+# define NNK_RS_USART2	2
+# define NNK_RS_USART3	3
+
+// behaviour of fprintf() when the Tx fifo is full
+enum nnk_rs_tx_policy {
+	NNK_RS_TX_BLOCK,	// wait for some free space (default)
+	NNK_RS_TX_DROP_NEWEST,	// drop the new character
+	NNK_RS_TX_DROP_OLDEST,	// drop the oldest queued character
+	NNK_RS_TX_DROP_LINE,	// drop the end of the current line
+};
+
+// USART instance
+// the fields are private, only allocate it and give it to the functions
+struct nnk_rs {
+	FILE file;			// stream for fprintf() and co
+	volatile u8* regs;		// USART registers
+
+	// fifoes on the caller buffers
+	struct nnk_fifo rx_fifo;
+	struct nnk_fifo tx_fifo;
+
+	// buffer for floating point operations
+	u8 fp_buf[RS_FP_BUF_LEN];
+
+	// hardware failures
+	u8 FE_cnt;			// Frame Error counter
+	u8 DOR_cnt;			// Data OverRun counter
+	u8 PE_cnt;			// Parity Error counter
+
+	// fifo failures
+	u8 rx_ovfl_cnt;
+
+	// Tx fifo full handling
+	enum nnk_rs_tx_policy tx_policy;
+	u8 tx_truncating;		// dropping the end of the current line
+	u16 tx_drop_cnt;		// dropped characters counter
+
+	// bulk transmission from a caller buffer
+	const u8* volatile wr_buf;	// caller buffer, NULL when no bulk write
+	u8 wr_len;			// caller buffer length
+	u8 wr_idx;			// next byte to send
+	u16 wr_ahead;			// fifo bytes queued before the bulk write
+	void (*wr_done)(void* misc);	// end of bulk write call-back
+	void* wr_misc;
+
+	// reception hook, replacing the rx fifo
+	void (*rx_hook)(u8 data, void* misc);
+	void* rx_hook_misc;
+
+	// idle line packetisation into a caller buffer
+	u8* idle_buf;			// caller buffer, NULL when not used
+	u8 idle_len;			// caller buffer length
+	volatile u8 idle_idx;		// next byte to store
+	u32 idle_gap;			// silence ending a frame
+	volatile u32 idle_last;		// time of the last received byte
+	void (*idle_done)(const u8* data, u8 len, void* misc);
+	void* idle_misc;
+
+	// bulk reception into a caller buffer
+	u8* volatile rd_buf;		// caller buffer, NULL when no bulk read
+	u8 rd_len;			// caller buffer length
+	u8 rd_idx;			// next byte to store
+	void (*rd_done)(void* misc);	// end of bulk read call-back
+	void* rd_misc;
+};
+
+// baud rates
+//
+// the baud value given to nnk_rs_init() and nnk_rs_open() holds
+// the 12-bit UBRR value and the U2X flag (bit 15).
+// NNK_RS_BAUD() computes it at compile time from F_CPU and the rate:
+// the double speed mode is selected when it lowers the error
+// and the build fails when the error is greater than NNK_RS_BAUD_TOL
+// (in per-mille, 2 % by default).
+// the rate shall be a constant expression.
+//
+// the B2400..B1000000 constants are only checked against NNK_RS_BAUD_STD_TOL
+// (4.5 % by default, beyond which a 8N1 link can not work),
+// as some of them are off by more than 2 % at usual clocks:
+// at 8 MHz, B57600 is 2.1 % off and B115200 3.5 % off,
+// so NNK_RS_BAUD(57600) and NNK_RS_BAUD(115200) do not build there
+// with the default tolerance.
+//
+# ifndef F_CPU
+#  define F_CPU		8000000UL	// historical clock of the library
+# endif
+
+# ifndef NNK_RS_BAUD_TOL
+#  define NNK_RS_BAUD_TOL	20
+# endif
+
+# ifndef NNK_RS_BAUD_STD_TOL
+#  define NNK_RS_BAUD_STD_TOL	45
+# endif
+
+# define NNK_RS_U2X		0x8000
+
+// clock divisors in normal (16) and double (8) speed modes, rounded
+# define NNK_RS_DIV(rate, k)	((F_CPU + (k) / 2 * (u32)(rate)) / ((k) * (u32)(rate)))
+
+// baud rate error in per-mille, 1000 when the divisor is out of range
+# define NNK_RS_ERR(rate, k)						\
+	( (NNK_RS_DIV(rate, k) == 0 || NNK_RS_DIV(rate, k) > 4096) ? 1000UL :	\
+	  ( (F_CPU / ((k) * NNK_RS_DIV(rate, k)) > (u32)(rate))		\
+	    ? (F_CPU / ((k) * NNK_RS_DIV(rate, k)) - (u32)(rate))	\
+	    : ((u32)(rate) - F_CPU / ((k) * NNK_RS_DIV(rate, k))) )	\
+	  * 1000UL / (u32)(rate) )
 
-# define B2400		207
-# define B4800		103
-# define B9600		51
-# define B19200		25
-# define B38400		12
-# define B57600		8
-# define B76800		6
-# define B115200	3
-# define B250000	1
-# define B500000	0
-
-extern void nnk_rs_init(u8 baud);		// setup for USART
+# define NNK_RS_USE_U2X(rate)	(NNK_RS_ERR(rate, 8) < NNK_RS_ERR(rate, 16))
+
+// fails to compile (negative array size) when the error is greater than tol
+# define NNK_RS_BAUD_CHECK(rate, tol)					\
+	(0 * sizeof(char[(NNK_RS_USE_U2X(rate) ? NNK_RS_ERR(rate, 8) : NNK_RS_ERR(rate, 16)) <= (tol) ? 1 : -1]))
+
+# define NNK_RS_BAUD_TOL_CHECKED(rate, tol)				\
+	((u16)(NNK_RS_BAUD_CHECK(rate, tol) +				\
+	 (NNK_RS_USE_U2X(rate) ? (NNK_RS_U2X | (NNK_RS_DIV(rate, 8) - 1)) : (NNK_RS_DIV(rate, 16) - 1))))
+
+# define NNK_RS_BAUD(rate)	NNK_RS_BAUD_TOL_CHECKED(rate, NNK_RS_BAUD_TOL)
+# define NNK_RS_BAUD_STD(rate)	NNK_RS_BAUD_TOL_CHECKED(rate, NNK_RS_BAUD_STD_TOL)
+
+# define B2400		NNK_RS_BAUD_STD(2400)
+# define B4800		NNK_RS_BAUD_STD(4800)
+# define B9600		NNK_RS_BAUD_STD(9600)
+# define B19200		NNK_RS_BAUD_STD(19200)
+# define B38400		NNK_RS_BAUD_STD(38400)
+# define B57600		NNK_RS_BAUD_STD(57600)
+# define B76800		NNK_RS_BAUD_STD(76800)
+# define B115200	NNK_RS_BAUD_STD(115200)
+# define B250000	NNK_RS_BAUD_STD(250000)
+# define B500000	NNK_RS_BAUD_STD(500000)
+# define B1000000	NNK_RS_BAUD_STD(1000000)
+
+extern void nnk_rs_init(u16 baud);		// setup for USART0
 						// baud given using provided macro
 						// interrupt mode
+						// bound to stdin and stdout
 
 extern void nnk_rs_cnt(u8* FE_cnt,		// return the values of Frame Error
 			u8* DOR_cnt,		// Data OverRun
 			u8* PE_cnt,		// Parity Error counters and
 			u8* rx_ovfl_cnt);	// rx fifo overflow counter
+						// of USART0
+
+// return the USART0 instance bound to stdin and stdout
+extern struct nnk_rs* nnk_rs_std(void);
+
+// setup of any USART in interrupt mode
+//
+// the Rx and Tx buffers belong to the caller
+// and shall remain allocated as long as the USART is used.
+// the instance stream &rs->file can be used with fprintf() and co.
+//
+// return KO if the USART does not exist, else OK
+//
+extern u8 nnk_rs_open(struct nnk_rs* rs, u8 usart, u16 baud, u8* rx_buf, u16 rx_len, u8* tx_buf, u16 tx_len);
+
+// return the values of the error counters of the instance
+extern void nnk_rs_dev_cnt(struct nnk_rs* rs, u8* FE_cnt, u8* DOR_cnt, u8* PE_cnt, u8* rx_ovfl_cnt);
+
+// set a hook called from the Rx ISR for each received byte
+// while set, the received bytes bypass the rx fifo and the bulk read
+// NULL restores the normal reception
+extern void nnk_rs_rx_hook_set(struct nnk_rs* rs, void (*hook)(u8 data, void* misc), void* misc);
+
+// bulk transfers
+//
+// the buffer is used in place by the ISR, so it shall remain allocated
+// till the end of the transfer.
+// the done call-back (may be NULL) is called from ISR context with misc
+// at the end of the transfer. a new transfer can be chained from it.
+//
+// only one bulk write and one bulk read can be pending at a time,
+// if not possible the functions return KO else OK
+//
+// the write is sent after the bytes already queued in the tx fifo (by fprintf)
+// the read first takes the bytes already waiting in the rx fifo
+//
+extern u8 nnk_rs_write(struct nnk_rs* rs, const u8* buf, u8 len, void (*done)(void* misc), void* misc);
+extern u8 nnk_rs_read_block(struct nnk_rs* rs, u8* buf, u8 len, void (*done)(void* misc), void* misc);
+
+// idle line packetisation
+//
+// each received byte is stored in buf and dated with nnk_time_get().
+// when the line stays silent for gap (in nnk_time unit, tenth of milli-second),
+// the received bytes are handed over as one frame to the done call-back.
+// meanwhile the bytes of the next frame are received in the rest of the buffer,
+// they are moved at its begin when done returns (those beyond len are dropped).
+// while set, the received bytes bypass the rx fifo and the bulk read.
+// a NULL buf restores the normal reception.
+//
+// the silence is checked by nnk_rs_idle_poll() that shall be called
+// periodically (from the time increment hook for instance)
+// with a period smaller than the gap.
+// done is called from the context of nnk_rs_idle_poll().
+//
+extern void nnk_rs_idle_set(struct nnk_rs* rs, u8* buf, u8 len, u32 gap, void (*done)(const u8* data, u8 len, void* misc), void* misc);
+extern void nnk_rs_idle_poll(struct nnk_rs* rs);
+
+// gap for a silence of tenths tenths of character (10 bits) at the given bit rate
+// for instance NNK_RS_IDLE_GAP(19200, 35) for the 3.5 characters of Modbus RTU
+# define NNK_RS_IDLE_GAP(rate, tenths)	((u32)(tenths) * 10000UL / (rate) + 1)
+
+// queue len bytes in the tx fifo in one go, after the bytes already queued
+// either all of them are queued or none (counted as dropped),
+// so the sequences of bytes from several contexts are never interleaved
+// if not possible the function returns KO else OK
+extern u8 nnk_rs_put_buf(struct nnk_rs* rs, const u8* buf, u16 len);
+
+// when no call-back is given, check if the bulk transfer is done
+extern u8 nnk_rs_write_is_fini(struct nnk_rs* rs);
+extern u8 nnk_rs_read_is_fini(struct nnk_rs* rs);
+
+// set the behaviour of fprintf() when the Tx fifo is full
+extern void nnk_rs_tx_policy_set(struct nnk_rs* rs, enum nnk_rs_tx_policy policy);
+
+// return the number of characters dropped by the Tx policy
+extern u16 nnk_rs_tx_drop_cnt(struct nnk_rs* rs);
 
 //extern u8 RS_lock(void* rs, void);		// lock the RS for exclusive use
 //extern u8 RS_unlock(void* rs, void);		// unlock the RS
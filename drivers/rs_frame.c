@@ -0,0 +1,226 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+#include "drivers/rs_frame.h"
+
+#include <util/crc16.h>		// _crc_ccitt_update()
+
+#include "drivers/rs.h"
+
+
+//------------------------------
+// private defines
+//
+
+#define NNK_RS_FRAME_CRC_INIT	0xffff
+
+#if NNK_RS_FRAME_ENC_LEN > 255
+# error "NNK_RS_FRAME_LEN is too big for the RS bulk write"
+#endif
+
+
+//------------------------------
+// private fonctions
+//
+
+static u16 nnk_rs_frame_crc(const u8* data, u8 len)
+{
+	u16 crc = NNK_RS_FRAME_CRC_INIT;
+
+	while ( len-- )
+		crc = _crc_ccitt_update(crc, *data++);
+
+	return crc;
+}
+
+
+// reset the decoder for the next frame
+static void nnk_rs_frame_rx_reset(struct nnk_rs_frame* fr)
+{
+	fr->rx_idx = 0;
+	fr->rx_code = 0xff;	// no zero before first block
+	fr->rx_left = 0;
+	fr->rx_drop = 0;
+}
+
+
+// store a decoded byte
+static void nnk_rs_frame_rx_store(struct nnk_rs_frame* fr, u8 data)
+{
+	if ( fr->rx_idx >= NNK_RS_FRAME_RAW_LEN ) {
+		fr->ovfl_cnt++;
+		fr->rx_drop = 1;
+		return;
+	}
+
+	fr->rx_buf[fr->rx_idx] = data;
+	fr->rx_idx++;
+}
+
+
+// end of frame delimiter received
+static void nnk_rs_frame_rx_end(struct nnk_rs_frame* fr)
+{
+	u8 len;
+	u16 crc;
+
+	// empty frame (consecutive delimiters) or already counted error
+	if ( fr->rx_drop || ((fr->rx_idx == 0) && (fr->rx_left == 0)) )
+		return;
+
+	// truncated block or no room for the CRC
+	if ( (fr->rx_left != 0) || (fr->rx_idx < 2) ) {
+		fr->cobs_cnt++;
+		return;
+	}
+
+	// check CRC
+	len = fr->rx_idx - 2;
+	crc = fr->rx_buf[len] | (fr->rx_buf[len + 1] << 8);
+	if ( crc != nnk_rs_frame_crc(fr->rx_buf, len) ) {
+		fr->crc_cnt++;
+		return;
+	}
+
+	fr->call_back(fr->rx_buf, len, fr->misc);
+}
+
+
+// COBS decoding on the fly, called from Rx ISR
+static void nnk_rs_frame_rx(u8 data, void* misc)
+{
+	struct nnk_rs_frame* fr = misc;
+
+	// delimiter
+	if ( data == 0x00 ) {
+		nnk_rs_frame_rx_end(fr);
+		nnk_rs_frame_rx_reset(fr);
+		return;
+	}
+
+	if ( fr->rx_drop )
+		return;
+
+	// data byte of the current block
+	if ( fr->rx_left ) {
+		fr->rx_left--;
+		nnk_rs_frame_rx_store(fr, data);
+		return;
+	}
+
+	// new block code: the previous block was followed by a zero
+	// except when it was a full one
+	if ( fr->rx_code != 0xff )
+		nnk_rs_frame_rx_store(fr, 0x00);
+
+	fr->rx_code = data;
+	fr->rx_left = data - 1;
+}
+
+
+// COBS encoding of one byte
+static void nnk_rs_frame_tx(struct nnk_rs_frame* fr, u8 data)
+{
+	if ( data != 0x00 ) {
+		*fr->tx_dst++ = data;
+		(*fr->tx_code)++;
+	}
+
+	// block end on zero or when full
+	if ( (data == 0x00) || (*fr->tx_code == 0xff) ) {
+		fr->tx_code = fr->tx_dst++;
+		*fr->tx_code = 1;
+	}
+}
+
+
+//------------------------------
+// public fonctions
+//
+
+// init the framed transport
+void nnk_rs_frame_init(struct nnk_rs_frame* fr, struct nnk_rs* rs, void (*call_back)(const u8* data, u8 len, void* misc), void* misc)
+{
+	fr->rs = rs;
+	fr->call_back = call_back;
+	fr->misc = misc;
+
+	fr->crc_cnt = 0;
+	fr->ovfl_cnt = 0;
+	fr->cobs_cnt = 0;
+
+	// wait for a first delimiter to synchronize
+	nnk_rs_frame_rx_reset(fr);
+	fr->rx_drop = 1;
+
+	nnk_rs_rx_hook_set(rs, nnk_rs_frame_rx, fr);
+}
+
+
+// stop the framed transport
+void nnk_rs_frame_stop(struct nnk_rs_frame* fr)
+{
+	nnk_rs_rx_hook_set(fr->rs, NULL, NULL);
+}
+
+
+// send a frame
+u8 nnk_rs_frame_send(struct nnk_rs_frame* fr, const u8* data, u8 len)
+{
+	u16 crc = NNK_RS_FRAME_CRC_INIT;
+
+	if ( (len > NNK_RS_FRAME_LEN) || !nnk_rs_write_is_fini(fr->rs) )
+		return KO;
+
+	// leading delimiter flushes any garbage on the receiver side
+	fr->tx_buf[0] = 0x00;
+	fr->tx_code = &fr->tx_buf[1];
+	*fr->tx_code = 1;
+	fr->tx_dst = &fr->tx_buf[2];
+
+	// payload then CRC, encoded in a single pass
+	while ( len-- ) {
+		crc = _crc_ccitt_update(crc, *data);
+		nnk_rs_frame_tx(fr, *data++);
+	}
+	nnk_rs_frame_tx(fr, crc & 0xff);
+	nnk_rs_frame_tx(fr, crc >> 8);
+
+	*fr->tx_dst++ = 0x00;
+
+	return nnk_rs_write(fr->rs, fr->tx_buf, fr->tx_dst - fr->tx_buf, NULL, NULL);
+}
+
+
+// check if the last frame is sent
+u8 nnk_rs_frame_is_fini(struct nnk_rs_frame* fr)
+{
+	return nnk_rs_write_is_fini(fr->rs);
+}
+
+
+// return the values of the reception error counters
+void nnk_rs_frame_cnt(struct nnk_rs_frame* fr, u8* crc_cnt, u8* ovfl_cnt, u8* cobs_cnt)
+{
+	*crc_cnt = fr->crc_cnt;
+	*ovfl_cnt = fr->ovfl_cnt;
+	*cobs_cnt = fr->cobs_cnt;
+}
@@ -0,0 +1,105 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// RS FRAME
+//
+// framed transport over the RS driver
+//
+// each frame is made of the payload followed by its CRC-16 (CCITT, LSB first),
+// COBS encoded and delimited by 0x00 bytes:
+//
+//   0x00 | COBS(payload + CRC) | 0x00
+//
+// the reception is decoded on the fly in the Rx ISR,
+// so only complete and valid frames reach the application.
+//
+
+#ifndef __RS_FRAME_H__
+# define __RS_FRAME_H__
+
+# include "type_def.h"
+# include "drivers/rs.h"
+
+// maximum payload length of a frame
+# ifndef NNK_RS_FRAME_LEN
+#  define NNK_RS_FRAME_LEN	32
+# endif
+
+// payload and CRC
+# define NNK_RS_FRAME_RAW_LEN	(NNK_RS_FRAME_LEN + 2)
+
+// COBS adds one byte every 254 bytes plus both delimiters
+# define NNK_RS_FRAME_ENC_LEN	(NNK_RS_FRAME_RAW_LEN + NNK_RS_FRAME_RAW_LEN / 254 + 1 + 2)
+
+// framed transport instance, one per USART
+// the fields are private, only allocate it and give it to the functions
+struct nnk_rs_frame {
+	struct nnk_rs* rs;		// underlying USART
+
+	// reception
+	u8 rx_buf[NNK_RS_FRAME_RAW_LEN];	// decoded data
+	u8 rx_idx;			// next decoded byte
+	u8 rx_code;			// current COBS block code
+	u8 rx_left;			// bytes left in the current block
+	u8 rx_drop:1;			// dropping till next delimiter
+
+	void (*call_back)(const u8* data, u8 len, void* misc);
+	void* misc;
+
+	// transmission
+	u8 tx_buf[NNK_RS_FRAME_ENC_LEN];	// encoded frame
+	u8* tx_code;			// code byte of the current block
+	u8* tx_dst;			// next encoded byte
+
+	// errors
+	u8 crc_cnt;
+	u8 ovfl_cnt;
+	u8 cobs_cnt;
+};
+
+
+// init the framed transport instance fr over the already opened USART rs
+// the instance belongs to the caller and shall remain allocated while used
+//
+// the call_back is called from the Rx ISR for each valid frame
+// with its payload and its length.
+// the payload buffer is reused for the next frame as soon as the call_back returns.
+//
+extern void nnk_rs_frame_init(struct nnk_rs_frame* fr, struct nnk_rs* rs, void (*call_back)(const u8* data, u8 len, void* misc), void* misc);
+
+// stop the framed transport, the RS driver is back to stream mode
+extern void nnk_rs_frame_stop(struct nnk_rs_frame* fr);
+
+// send a frame
+// the payload is encoded in an internal buffer, so it can be reused at once
+// return KO if the previous frame is still being sent or len is too big, else OK
+extern u8 nnk_rs_frame_send(struct nnk_rs_frame* fr, const u8* data, u8 len);
+
+// check if the last frame is sent
+extern u8 nnk_rs_frame_is_fini(struct nnk_rs_frame* fr);
+
+// return the values of the reception error counters
+extern void nnk_rs_frame_cnt(struct nnk_rs_frame* fr,
+			u8* crc_cnt,		// bad CRC
+			u8* ovfl_cnt,		// too long frame
+			u8* cobs_cnt);		// bad COBS encoding
+
+#endif	// __RS_FRAME_H__
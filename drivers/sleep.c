@@ -23,6 +23,9 @@
 
 #include <avr/io.h>			// UBRRH, UBBRL, UCSR?
 #include <avr/interrupt.h>	// ISR()
+#include <avr/sleep.h>		// set_sleep_mode()
+
+#include "utils/time.h"
 
 
 //------------------------------
@@ -30,14 +33,20 @@
 //
 
 static struct {
-	// mask of the registered clients
-	u16 register_mask;
+	// registered clients
+	struct nnk_slp_client* clients;
+
+	// number of registered clients not requesting sleep
+	u16 awake;
+
+	// number of clients per tolerated sleep mode
+	u16 mode_cnt[NNK_SLP_NB_MODES];
 
-	// mask of the current clients requesting sleep
-	u16 current_mask;
+	// number of driver transfers needing the I/O clock
+	u8 io;
 
-	// bit value for the next registering client
-	u8 mask_bit;
+	// number of sleep attempts denied
+	u16 denied;
 
 	// number of times the sleep mode is reached
 	u16 stat;
@@ -48,6 +57,51 @@ static struct {
 // private fonctions
 //
 
+// AVR sleep mode values
+static const u8 nnk_slp_modes[NNK_SLP_NB_MODES] = {
+	SLEEP_MODE_IDLE,
+	SLEEP_MODE_ADC,
+	SLEEP_MODE_PWR_SAVE,
+	SLEEP_MODE_PWR_DOWN,
+};
+
+
+// check the wake up sources the driver knows about
+static enum nnk_slp_mode nnk_slp_wake_check(enum nnk_slp_mode mode)
+{
+	if ( mode == NNK_SLP_IDLE )
+		return mode;
+
+	// a driver transfer or an EEPROM write needs the I/O clock
+	if ( slp.io || (EECR & (_BV(EEPE) | _BV(EERIE))) )
+		return NNK_SLP_IDLE;
+
+	// bytes queued for emission
+	if ( UCSR0B & _BV(UDRIE0) )
+		return NNK_SLP_IDLE;
+#ifdef UCSR1B
+	if ( UCSR1B & _BV(UDRIE1) )
+		return NNK_SLP_IDLE;
+#endif
+
+	// a TWI START or STOP not yet sent on the bus
+	if ( TWCR & (_BV(TWSTA) | _BV(TWSTO)) )
+		return NNK_SLP_IDLE;
+
+	// a running timer2 only keeps counting out of idle if it is asynchronous
+	if ( (TCCR2B & (_BV(CS22) | _BV(CS21) | _BV(CS20))) && (mode != NNK_SLP_PWR_DOWN) ) {
+		if ( !(ASSR & _BV(AS2)) )
+			return NNK_SLP_IDLE;
+
+		// its pending register updates must be done,
+		// else it could not wake up the CPU
+		while ( ASSR & (_BV(TCN2UB) | _BV(OCR2AUB) | _BV(OCR2BUB) | _BV(TCR2AUB) | _BV(TCR2BUB)) )
+			;
+	}
+
+	return mode;
+}
+
 
 //------------------------------
 // public fonctions
@@ -57,61 +111,201 @@ static struct {
 void nnk_slp_init(void)
 {
 	// reset the whole structure
-	slp.register_mask = 0;
-	slp.current_mask = 0;
-	slp.mask_bit = 0;
+	slp.clients = NULL;
+	slp.awake = 0;
+	for (u8 i = 0; i < NNK_SLP_NB_MODES; i++)
+		slp.mode_cnt[i] = 0;
+	slp.denied = 0;
 	slp.stat = 0;
 
-	// enable idle sleep mode 
-	MCUCR |= _BV(SE);
+	// the driver transfers count is kept, one can be running
+
+	// sleep is only enabled just before sleeping
+	sleep_disable();
 }
 
 
-// return the sleep mask for the registering client
-u16 nnk_slp_register(void)
+// register a client
+void nnk_slp_register(struct nnk_slp_client* cl)
 {
-	u16 mask;
+	// the client only tolerates idle mode until it says otherwise
+	cl->mode = NNK_SLP_IDLE;
+	cl->requesting = 0;
+	cl->since = nnk_time_get();
+	cl->denied_at = slp.denied;
+	cl->stats.awake = 0;
+	cl->stats.blocked = 0;
+	cl->stats.requests = 0;
 
-	// compute mask for current registering client
-	mask = 1 << slp.mask_bit;
+	u8 sreg = SREG;
+	cli();
 
-	// update the mask for the registered clients
-	slp.register_mask |= mask;
+	// it prevents sleep until its first request
+	slp.awake++;
+	slp.mode_cnt[NNK_SLP_IDLE]++;
 
-	// increment the counter for the next client
-	slp.mask_bit++;
+	cl->next = slp.clients;
+	slp.clients = cl;
 
-	// get to the client its mask
-	return mask;
+	SREG = sreg;
+}
+
+
+// a registered client sets the deepest sleep mode it tolerates
+void nnk_slp_mode_set(struct nnk_slp_client* cl, enum nnk_slp_mode mode)
+{
+	if ( mode >= NNK_SLP_NB_MODES )
+		return;
+
+	u8 sreg = SREG;
+	cli();
+
+	slp.mode_cnt[cl->mode]--;
+	cl->mode = mode;
+	slp.mode_cnt[mode]++;
+
+	SREG = sreg;
+}
+
+
+// return the sleep mode compatible with all the clients
+enum nnk_slp_mode nnk_slp_mode_get(void)
+{
+	u8 mode;
+
+	// the lightest mode tolerated by a client
+	for (mode = NNK_SLP_IDLE; mode < NNK_SLP_PWR_DOWN; mode++) {
+		if ( slp.mode_cnt[mode] )
+			break;
+	}
+
+	return mode;
 }
 
 
 // a registered client can request to sleep
-u8 nnk_slp_request(u16 mask)
+u8 nnk_slp_request(struct nnk_slp_client* cl)
 {
-	// add client mask to the global mask
-	slp.current_mask |= mask;
+	u8 sreg = SREG;
+	cli();
 
-	// if the mask is complete
-	if (slp.current_mask == slp.register_mask) {
-		// sleep
-		__asm__ __volatile__ ("sleep");
+	// the client stops preventing sleep
+	if ( !cl->requesting ) {
+		cl->requesting = 1;
+		cl->stats.awake += nnk_time_get() - cl->since;
+		cl->stats.blocked += slp.denied - cl->denied_at;
+		cl->stats.requests++;
+		slp.awake--;
+	}
 
-		// on wake-up, update stats
-		slp.stat++;
+	// some clients are still awake
+	if ( slp.awake ) {
+		slp.denied++;
+		SREG = sreg;
 
-		// and return OK
-		return OK;
+		return KO;
 	}
 
-	// else return KO
-	return KO;
+	// sleep in the deepest mode tolerated by the clients
+	set_sleep_mode(nnk_slp_modes[nnk_slp_wake_check(nnk_slp_mode_get())]);
+	sleep_enable();
+
+	// the instruction following sei is always executed before any interrupt,
+	// so an interrupt occuring since the check can not be lost
+	__asm__ __volatile__ ("sei" "\n\t" "sleep" ::: "memory");
+
+	sleep_disable();
+
+	// on wake-up, update stats
+	slp.stat++;
+	SREG = sreg;
+
+	return OK;
 }
 
 
 // a registered client can unrequest to sleep
-void nnk_slp_unrequest(u16 mask)
+void nnk_slp_unrequest(struct nnk_slp_client* cl)
 {
-	// remove client mask from the global mask
-	slp.current_mask &= ~mask;
+	u8 sreg = SREG;
+	cli();
+
+	// the client prevents sleep again
+	if ( cl->requesting ) {
+		cl->requesting = 0;
+		cl->since = nnk_time_get();
+		cl->denied_at = slp.denied;
+		slp.awake++;
+	}
+
+	SREG = sreg;
+}
+
+
+// get the statistics of a client
+void nnk_slp_stats_get(struct nnk_slp_client* cl, struct nnk_slp_stats* stats)
+{
+	u8 sreg = SREG;
+	cli();
+
+	*stats = cl->stats;
+
+	// current awake period
+	if ( !cl->requesting ) {
+		stats->awake += nnk_time_get() - cl->since;
+		stats->blocked += slp.denied - cl->denied_at;
+	}
+
+	SREG = sreg;
+}
+
+
+// reset the statistics of all the clients
+void nnk_slp_stats_reset(void)
+{
+	u8 sreg = SREG;
+	cli();
+
+	for (struct nnk_slp_client* cl = slp.clients; cl != NULL; cl = cl->next) {
+		cl->since = nnk_time_get();
+		cl->denied_at = slp.denied;
+		cl->stats.awake = 0;
+		cl->stats.blocked = 0;
+		cl->stats.requests = 0;
+	}
+	slp.stat = 0;
+
+	SREG = sreg;
+}
+
+
+// number of times the sleep mode is reached
+u16 nnk_slp_count(void)
+{
+	return slp.stat;
+}
+
+
+// a driver transfer needs the I/O clock
+void nnk_slp_io_hold(void)
+{
+	u8 sreg = SREG;
+	cli();
+
+	slp.io++;
+
+	SREG = sreg;
+}
+
+
+// the driver transfer is over
+void nnk_slp_io_release(void)
+{
+	u8 sreg = SREG;
+	cli();
+
+	if ( slp.io )
+		slp.io--;
+
+	SREG = sreg;
 }
@@ -24,14 +24,80 @@
 
 # include "type_def.h"
 
+// sleep modes, from the lightest to the deepest
+//
+// idle : everything but the CPU keeps running
+// ADC : ADC noise reduction, only the ADC, TWI address match, INTx, PCINTx
+//	and the asynchronous timer2 can wake up
+// power-save : as power-down but the asynchronous timer2 keeps running
+// power-down : only TWI address match, INTx, PCINTx and the watchdog can wake up
+//
+// whatever the clients tolerate, the sleep is limited to idle
+// while the I/O clock is needed to end the work in progress:
+// an EEPROM write, bytes queued for a USART emission, a pending TWI START or STOP,
+// or a transfer held by a driver (SPI and MSPIM transfers, TWI master comm).
+// the last byte in a USART shift register is not seen,
+// a client sending just before sleeping should wait for its TXCn flag.
+enum nnk_slp_mode {
+	NNK_SLP_IDLE,
+	NNK_SLP_ADC,
+	NNK_SLP_PWR_SAVE,
+	NNK_SLP_PWR_DOWN,
+	NNK_SLP_NB_MODES
+};
+
+// a sleep client
+// the descriptor belongs to the client and is linked in the registry
+struct nnk_slp_client {
+	// private
+	u8 mode;			// deepest sleep mode tolerated
+	u8 requesting;			// requesting to sleep
+	u32 since;			// time of the last unrequest
+	u16 denied_at;			// sleep denials count at the last unrequest
+
+	struct nnk_slp_stats {
+		u32 awake;		// time spent preventing sleep (in nnk_time units)
+		u16 blocked;		// sleep attempts denied while not requesting
+		u16 requests;		// number of sleep requests
+	} stats;
+
+	struct nnk_slp_client* next;
+};
+
 extern void nnk_slp_init(void);           // setup for SLEEP system
 
-extern u16 nnk_slp_register(void);        // return the sleep mask for the registering client
+extern void nnk_slp_register(struct nnk_slp_client* cl);
+                                          // register a client, initially not requesting to sleep
+                                          // the client only tolerates the idle mode by default
+
+extern void nnk_slp_mode_set(struct nnk_slp_client* cl, enum nnk_slp_mode mode);
+                                          // a registered client sets the deepest sleep mode it tolerates
+                                          // it can be changed at any time (idle during a transfer for instance)
 
-extern u8 nnk_slp_request(u16 mask);      // a registered client can request to sleep
+extern enum nnk_slp_mode nnk_slp_mode_get(void);
+                                          // return the sleep mode compatible with all the clients
+
+extern u8 nnk_slp_request(struct nnk_slp_client* cl);
+                                          // a registered client can request to sleep
                                           // the function returns OK if sleep has happened, KO else
 
-extern void nnk_slp_unrequest(u16 mask);  // a registered client can unrequest to sleep
+extern void nnk_slp_unrequest(struct nnk_slp_client* cl);
+                                          // a registered client can unrequest to sleep
+                                          // it can be called from an ISR
+
+extern void nnk_slp_stats_get(struct nnk_slp_client* cl, struct nnk_slp_stats* stats);
+                                          // get the statistics of a client, current awake period included
+
+extern void nnk_slp_stats_reset(void);    // reset the statistics of all the clients
+
+extern u16 nnk_slp_count(void);           // number of times the sleep mode is reached
+
+extern void nnk_slp_io_hold(void);        // a driver starts a transfer the hardware can not be seen running,
+                                          // the sleep is limited to idle until it is released
+                                          // it can be called from an ISR
+
+extern void nnk_slp_io_release(void);     // the driver transfer is over
+                                          // it can be called from an ISR
 
 
 # ifdef __PT_H__
@@ -1,27 +1,79 @@
 #include "spi.h"
+#include "sleep.h"
 
 #include <avr/io.h>
 #include <avr/interrupt.h>	// ISR()
 
 //
-// in master mode, the SS pin is driven by the code
-// for projects, égère and TRoy 2, the pin PB0 is used
-// but in slave mode, it is mandatory to use PB2
+// in master mode, the chip select is driven by the code
+// for projects, égère and TRoy 2, the pin PB0 is used (default)
+// any other pin can be set with nnk_spi_cs_set()
+// but in slave mode, it is mandatory to use the hardware /SS pin
 //
 
 //-------------------------------------------
-// private functions
+// private defines
 //
 
+// SPI pins
+#if defined(__AVR_ATmega48__) || defined(__AVR_ATmega88__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__)
+# define NNK_SPI_SS	PB2
+# define NNK_SPI_MOSI	PB3
+# define NNK_SPI_MISO	PB4
+# define NNK_SPI_SCK	PB5
+
+// pin change interrupt of /SS
+# define NNK_SPI_SS_vect	PCINT0_vect
+# define NNK_SPI_SS_PCMSK	PCMSK0
+# define NNK_SPI_SS_PCINT	PCINT2
+# define NNK_SPI_SS_PCIE	PCIE0
+#else	// ATmega164/324/644/1284
+# define NNK_SPI_SS	PB4
+# define NNK_SPI_MOSI	PB5
+# define NNK_SPI_MISO	PB6
+# define NNK_SPI_SCK	PB7
+
+// pin change interrupt of /SS
+# define NNK_SPI_SS_vect	PCINT1_vect
+# define NNK_SPI_SS_PCMSK	PCMSK1
+# define NNK_SPI_SS_PCINT	PCINT12
+# define NNK_SPI_SS_PCIE	PCIE1
+#endif
+
+// statistics update
+#if NNK_SPI_STATS
+# define NNK_SPI_STAT_INC(field)	spi.stats.field++
+# define NNK_SPI_STAT_ADD(field, n)	spi.stats.field += (n)
+#else
+# define NNK_SPI_STAT_INC(field)	do {} while (0)
+# define NNK_SPI_STAT_ADD(field, n)	do {} while (0)
+#endif
+
+
+//-------------------------------------------
+// private variables
+//
+
+// default chip select
+static const struct nnk_spi_cs nnk_spi_default_cs = {
+	.port = &PORTB,
+	.pin = PB0,
+	.active_high = 0,
+};
+
 static struct {
 	enum nnk_spi_behaviour behaviour:2;
 
 	volatile u8 fini:1;	// flag to be used in blocking mode
 	u8 error:1;			// transfert on error
+	u8 held:1;			// the sleep is limited by the running transfer
 
 	// current transfert handling
 	enum nnk_spi_state state:4;
-	u8 index;
+	u16 index;
+
+	// current clock divisor
+	enum nnk_spi_clock_div clock_div;
 
 	// reception handling
 	u8* rx_buf;
@@ -31,14 +83,28 @@ static struct {
 	const u8* tx_buf;
 	u8 tx_len;
 
+	// slave next response, taken at next selection
+	const u8* volatile tx_next_buf;
+	volatile u8 tx_next_len;
+
+	// master segments handling
+	const struct nnk_spi_seg* seg;	// current segment
+	u8 seg_nb;			// segments left including the current one
+	struct nnk_spi_seg segs[2];	// segments of nnk_spi_master()
+
+	// chip select handling
+	const struct nnk_spi_cs* cs;
+	u8 cs_keep:1;		// keep it asserted at end of transfer
+	u8 cs_active:1;		// currently asserted
+
 	// call-back
 	void (*call_back)(enum nnk_spi_state st, void* misc);
 	void* misc;
 
-#ifdef STATS
+#if NNK_SPI_STATS
 	// stats
-	u16 false_triggers;
-	u16 overflows;
+	struct nnk_spi_stats stats;
+	u16 (*clock)(void);	// to measure the ISR duration
 #endif
 } spi;
 
@@ -47,117 +113,191 @@ static struct {
 // private functions
 //
 
-ISR(SPI_STC_vect)
+static void nnk_spi_cs_assert(void)
 {
+	const struct nnk_spi_cs* cs = spi.cs;
+
+	if ( (cs == NULL) || spi.cs_active )
+		return;
+
+	if ( cs->active_high )
+		*cs->port |= _BV(cs->pin);
+	else
+		*cs->port &= ~_BV(cs->pin);
+
+	spi.cs_active = 1;
+}
+
+
+static void nnk_spi_cs_deassert(void)
+{
+	const struct nnk_spi_cs* cs = spi.cs;
+
+	if ( (cs == NULL) || !spi.cs_active )
+		return;
+
+	if ( cs->active_high )
+		*cs->port &= ~_BV(cs->pin);
+	else
+		*cs->port |= _BV(cs->pin);
+
+	spi.cs_active = 0;
+}
+
+
+// leave the running state
+// releasing the sleep limit of an interrupt driven transfer whatever its end
+static void nnk_spi_idle(void)
+{
+	spi.state = NNK_SPI_IDLE;
+
+	if ( spi.held ) {
+		spi.held = 0;
+		nnk_slp_io_release();
+	}
+}
+
+
+// take the next response as slave and preload its first byte
+// so that it is ready as soon as the master selects and clocks
+static void nnk_spi_slave_load(void)
+{
+	spi.tx_buf = spi.tx_next_buf;
+	spi.tx_len = spi.tx_next_len;
+	SPDR = ( spi.tx_len != 0 ) ? spi.tx_buf[0] : 0xff;
+}
+
+
+static inline void nnk_spi_isr(void)
+{
+	u8 data;
+
 	// handling depends on set behaviour 
 	switch ( spi.behaviour ) {
 	case NNK_SPI_MASTER:
 		// if the interrupt is not awaited
 		if ( spi.state != NNK_SPI_RUNNING ) {
-#ifdef STATS
-			// update stats
-			spi.false_triggers++;
-#endif
+			NNK_SPI_STAT_INC(spurious);
 
 			// signal error
 			spi.call_back(NNK_SPI_ERROR, spi.misc);
-			spi.state = NNK_SPI_IDLE;
+			nnk_spi_idle();
 
 			return;
 		}
 
-		// if there are still data to receive
-		if ( spi.index < spi.rx_len ) {
-			// retrieve it from rx register
-			spi.rx_buf[spi.index] = SPDR;
-		}
-        else {
-            // just consume the received data
-            (void)SPDR;
-        }
+		// retrieve received data unless discarded
+		data = SPDR;
+		if ( spi.seg->rx != NULL )
+			spi.seg->rx[spi.index] = data;
 
 		// update index
 		spi.index++;
+		NNK_SPI_STAT_INC(bytes);
 
-		// when emitting buffer is empty and receiving buffer is full 
-		if ( (spi.index >= spi.tx_len) && (spi.index >= spi.rx_len) ) {
-			// signal end of transmission
-			spi.call_back(NNK_SPI_MASTER_END, spi.misc);
-			PORTB |= _BV(PB0);	// set /SS high to block slave
+		// at end of segment, go to the next non empty one
+		if ( spi.index >= spi.seg->len ) {
+			spi.index = 0;
+			do {
+				spi.seg++;
+				spi.seg_nb--;
+			} while ( spi.seg_nb && (spi.seg->len == 0) );
+		}
+
+		// when every segment is done
+		if ( spi.seg_nb == 0 ) {
+			// unselect slave unless a chained transfer follows
+			if ( !spi.cs_keep )
+				nnk_spi_cs_deassert();
 
 			// reset internals
-			spi.state = NNK_SPI_IDLE;
+			nnk_spi_idle();
 			spi.index = 0;
+			NNK_SPI_STAT_INC(transfers);
+
+			// signal end of transmission
+			// a new transfer can be started from the call-back
+			spi.call_back(NNK_SPI_MASTER_END, spi.misc);
 			break;
 		}
 
-		// if there are still data to send
-		if ( spi.index < spi.tx_len ) {
-			// update tx register
-			SPDR = spi.tx_buf[spi.index];
-		}
-		else {
-			// no more data to send but apparently still some to receive
-			// so send useless byte
-			SPDR = 0xff;
-		}
+		// send next data or fill byte
+		SPDR = ( spi.seg->tx != NULL ) ? spi.seg->tx[spi.index] : 0xff;
 		break;
 
 	case NNK_SPI_SLAVE:
-		// if the interrupt is not awaited
-		if ( (spi.state != NNK_SPI_IDLE) || (spi.state != NNK_SPI_RUNNING) ) {
-#ifdef STATS
-			// update stats
-			spi.false_triggers++;
-#endif
+		// if the interrupt is not awaited (/SS is high)
+		if ( spi.state != NNK_SPI_RUNNING ) {
+			NNK_SPI_STAT_INC(spurious);
+			(void)SPDR;
 
 			// signal error
 			spi.call_back(NNK_SPI_ERROR, spi.misc);
-			spi.state = NNK_SPI_IDLE;
 
 			return;
 		}
 
-		// on start of slave reception
-		if ( spi.index == 0 ) {
-			// signal it to have the data buffer set
-			spi.call_back(NNK_SPI_SLAVE_BEGIN, spi.misc);
-
-			// start reception process
-			spi.state = NNK_SPI_RUNNING;
-		}
-
-		// if there is still empty place for the data to receive
-		if (  spi.index < spi.rx_len ) {
-			// retrieve it from rx register
-			spi.rx_buf[spi.index] = SPDR;
-
-			// provide stub data in emission
-			SPDR = 0xff;
-		}
+		// retrieve received data if there is still empty place for it
+		data = SPDR;
+		if ( spi.index < spi.rx_len )
+			spi.rx_buf[spi.index] = data;
+		else if ( spi.index == spi.rx_len )
+			NNK_SPI_STAT_INC(errors);	// count the overrun once per transaction
 
 		// update index
 		spi.index++;
+		NNK_SPI_STAT_INC(bytes);
 
-		// if received buffer is full
-		if ( spi.index >= spi.rx_len ) {
-			// signal end of transmission
-			spi.call_back(NNK_SPI_SLAVE_END, spi.misc);
-			spi.state = NNK_SPI_IDLE;
+		// provide next data or stub data in emission
+		SPDR = ( spi.index < spi.tx_len ) ? spi.tx_buf[spi.index] : 0xff;
+
+		// too late, the master has already started the next byte
+		if ( SPSR & _BV(WCOL) ) {
+			(void)SPDR;	// clear the flag
+			NNK_SPI_STAT_INC(errors);
 		}
 		break;
 
 	case NNK_SPI_RESET:
-#ifdef STATS
-		spi.false_triggers++;
-#endif
+		NNK_SPI_STAT_INC(spurious);
 		spi.call_back(NNK_SPI_ERROR, spi.misc);
-		spi.state = NNK_SPI_IDLE;
+		nnk_spi_idle();
 		break;
 	}
 }
 
 
+ISR(SPI_STC_vect)
+{
+#if NNK_SPI_STATS
+	u16 (*clock)(void) = spi.clock;
+	u16 start = 0;
+	u16 duration;
+
+	if ( clock != NULL )
+		start = clock();
+#endif
+
+	nnk_spi_isr();
+
+#if NNK_SPI_STATS
+	if ( clock != NULL ) {
+		duration = clock() - start;
+		if ( duration > spi.stats.isr_max )
+			spi.stats.isr_max = duration;
+	}
+#endif
+}
+
+
+#ifdef NNK_SPI_SS_ISR
+ISR(NNK_SPI_SS_vect)
+{
+	nnk_spi_slave_ss_edge();
+}
+#endif
+
+
 // default call-back only useful for blocking mode
 static void nnk_spi_default_call_back(enum nnk_spi_state st, void* misc)
 {
@@ -174,84 +314,117 @@ static void nnk_spi_default_call_back(enum nnk_spi_state st, void* misc)
 
 void nnk_spi_init(enum nnk_spi_behaviour behaviour, enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div)
 {
+	// a running transfer is dropped
+	nnk_spi_idle();
+
 	// default mode
 	spi.behaviour = NNK_SPI_RESET;
 
 	switch ( behaviour ) {
 	case NNK_SPI_MASTER:
 		SPCR = _BV(MSTR);
-		DDRB |= _BV(PB7);	// SCK as output
-		DDRB |= _BV(PB5);	// MOSI as output
-		DDRB |= _BV(PB0);	// /SS as output
-		PORTB |= _BV(PB0);	// /SS is high to block slave
+		DDRB |= _BV(NNK_SPI_SCK);	// SCK as output
+		DDRB |= _BV(NNK_SPI_MOSI);	// MOSI as output
+		DDRB |= _BV(NNK_SPI_SS);	// hardware /SS as output to stay master
+
+		// default chip select
+		spi.cs = NULL;
+		spi.cs_active = 0;
+		nnk_spi_cs_init(&nnk_spi_default_cs);
+		nnk_spi_cs_set(&nnk_spi_default_cs, FALSE);
 		break;
 
 	case NNK_SPI_SLAVE:
 		SPCR = 0;
-		DDRB &= ~_BV(PB2);	// /SS as input
-		DDRB &= ~_BV(PB6);	// MISO as input
+		DDRB &= ~_BV(NNK_SPI_SS);	// /SS as input
+		DDRB |= _BV(NNK_SPI_MISO);	// MISO as output
+
+		// no response yet
+		spi.tx_buf = NULL;
+		spi.tx_len = 0;
+		spi.tx_next_buf = NULL;
+		spi.tx_next_len = 0;
+		spi.rx_len = 0;
+
+		// transactions are framed by /SS edges
+		NNK_SPI_SS_PCMSK |= _BV(NNK_SPI_SS_PCINT);
+		PCICR |= _BV(NNK_SPI_SS_PCIE);
 		break;
 
 	default:
 		SPCR = 0;
-		DDRB &= ~_BV(PB2);	// /SS as input
+		DDRB &= ~_BV(NNK_SPI_SS);	// /SS as input
 		return;
 		break;
 	}
 
+	// mode, data order and clock
+	if ( nnk_spi_config(mode, data_order, clock_div) == KO )
+		return;
+
+	// configuration passed : set the correct behaviour
+	spi.behaviour = behaviour;
+
+	// reset internals
+	nnk_spi_idle();
+	spi.index = 0;
+	spi.call_back = nnk_spi_default_call_back;
+	spi.misc = NULL;
+	nnk_spi_stats_reset();
+
+	// finally enable the SPI and its interrupt
+	SPCR |= _BV(SPE);
+	SPCR |= _BV(SPIE);
+
+	// stub response till one is set
+	if ( behaviour == NNK_SPI_SLAVE )
+		nnk_spi_slave_load();
+}
+
+// set the mode, the data order and the clock of the SPI block
+u8 nnk_spi_config(enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div)
+{
+	u8 spcr = SPCR & ~(_BV(CPOL) | _BV(CPHA) | _BV(DORD));
+
 	switch ( mode ) {
 	case NNK_SPI_ZERO:	// CPOL = 0 and CPHA = 0
 		break;
 
 	case NNK_SPI_ONE:	// CPOL = 0 and CPHA = 1
-		SPCR |= _BV(CPHA);
+		spcr |= _BV(CPHA);
 		break;
 
 	case NNK_SPI_TWO:	// CPOL = 1 and CPHA = 0
-		SPCR |= _BV(CPOL);
+		spcr |= _BV(CPOL);
 		break;
 
 	case NNK_SPI_THREE:	// CPOL = 1 and CPHA = 1
-		SPCR |= _BV(CPOL);
-		SPCR |= _BV(CPHA);
+		spcr |= _BV(CPOL);
+		spcr |= _BV(CPHA);
 		break;
 
 	default:
-		return;
+		return KO;
 		break;
 	}
 
 	switch ( data_order ) {
 	case NNK_SPI_LSB:
-		SPCR |= _BV(DORD);
+		spcr |= _BV(DORD);
 		break;
 
 	case NNK_SPI_MSB:
 		break;
 
 	default:
-		return;
+		return KO;
 		break;
 	}
 
+	SPCR = spcr;
 	nnk_spi_set_clock(clock_div);
 
-	// configuration passed : set the correct behaviour
-	spi.behaviour = behaviour;
-
-	// reset internals
-	spi.state = NNK_SPI_IDLE;
-	spi.index = 0;
-	spi.call_back = nnk_spi_default_call_back;
-	spi.misc = NULL;
-#ifdef STATS
-	spi.false_triggers = 0;
-	spi.overflows = 0;
-#endif
-
-	// finally enable the SPI and its interrupt
-	SPCR |= _BV(SPE);
-	SPCR |= _BV(SPIE);
+	return OK;
 }
 
 // set the SPI clock speed
@@ -295,8 +468,51 @@ void nnk_spi_set_clock(enum nnk_spi_clock_div clock_div)
         return;
         break;
     }
+
+    spi.clock_div = clock_div;
+}
+
+// set a chip select pin as an inactive output
+void nnk_spi_cs_init(const struct nnk_spi_cs* cs)
+{
+	// DDRx is just below PORTx
+	if ( cs->active_high )
+		*cs->port &= ~_BV(cs->pin);
+	else
+		*cs->port |= _BV(cs->pin);
+	*(cs->port - 1) |= _BV(cs->pin);
+}
+
+
+// set the chip select of the next transfers
+u8 nnk_spi_cs_set(const struct nnk_spi_cs* cs, u8 keep)
+{
+	if ( spi.state != NNK_SPI_IDLE )
+		return KO;
+
+	// release a previous chip select still asserted
+	if ( cs != spi.cs )
+		nnk_spi_cs_deassert();
+
+	spi.cs = cs;
+	spi.cs_keep = keep ? 1 : 0;
+
+	return OK;
+}
+
+
+// release a chip select kept asserted
+u8 nnk_spi_cs_release(void)
+{
+	if ( spi.state != NNK_SPI_IDLE )
+		return KO;
+
+	nnk_spi_cs_deassert();
+
+	return OK;
 }
 
+
 // call-back init
 void nnk_spi_call_back_set(void (*call_back)(enum nnk_spi_state st, void* misc), void* misc)
 {
@@ -305,27 +521,117 @@ void nnk_spi_call_back_set(void (*call_back)(enum nnk_spi_state st, void* misc),
 }
 
 
+// polled transmission as master
+static inline void nnk_spi_master_poll(void)
+{
+	const struct nnk_spi_seg* seg;
+	u8 i;
+	u8 data;
+
+	// no interrupt while polling
+	SPCR &= ~_BV(SPIE);
+
+	for ( seg = spi.seg; spi.seg_nb; seg++, spi.seg_nb-- ) {
+		NNK_SPI_STAT_ADD(bytes, seg->len);
+
+		for ( i = 0; i < seg->len; i++ ) {
+			SPDR = ( seg->tx != NULL ) ? seg->tx[i] : 0xff;
+
+			// wait for the byte to be shifted
+			while ( !(SPSR & _BV(SPIF)) ) {
+			}
+
+			// reading SPDR after SPSR clears SPIF
+			data = SPDR;
+			if ( seg->rx != NULL )
+				seg->rx[i] = data;
+		}
+	}
+
+	SPCR |= _BV(SPIE);
+
+	// unselect slave unless a chained transfer follows
+	if ( !spi.cs_keep )
+		nnk_spi_cs_deassert();
+
+	nnk_spi_idle();
+	spi.index = 0;
+	NNK_SPI_STAT_INC(transfers);
+
+	// signal end of transmission from the caller context
+	spi.call_back(NNK_SPI_MASTER_END, spi.misc);
+}
+
+
 // handle a transmission as master
 u8 nnk_spi_master(const u8* const tx_buf, u8 tx_len, u8* const rx_buf, u8 rx_len)
 {
+	u8 n;
+
 	// check initial conditions
 	if ( (spi.state != NNK_SPI_IDLE) || (spi.behaviour != NNK_SPI_MASTER) ) {
 		return KO;
 	}
 
+	// full duplex part
+	n = ( tx_len < rx_len ) ? tx_len : rx_len;
+	spi.segs[0].tx = tx_buf;
+	spi.segs[0].rx = rx_buf;
+	spi.segs[0].len = n;
+
+	// then either tx or rx only part
+	spi.segs[1].tx = ( tx_len > n ) ? tx_buf + n : NULL;
+	spi.segs[1].rx = ( rx_len > n ) ? rx_buf + n : NULL;
+	spi.segs[1].len = ( tx_len > n ) ? tx_len - n : rx_len - n;
+
+	return nnk_spi_master_sg(spi.segs, 2);
+}
+
+
+// handle a scatter-gather transmission as master
+u8 nnk_spi_master_sg(const struct nnk_spi_seg* segs, u8 nb)
+{
+	u8 i;
+	u16 len = 0;
+
+	// check initial conditions
+	if ( (spi.state != NNK_SPI_IDLE) || (spi.behaviour != NNK_SPI_MASTER) ) {
+		return KO;
+	}
+
+	// skip leading empty segments and compute total length
+	while ( nb && (segs->len == 0) ) {
+		segs++;
+		nb--;
+	}
+	for ( i = 0; i < nb; i++ )
+		len += segs[i].len;
+
+	// nothing to transfer
+	if ( len == 0 )
+		return KO;
+
 	// save contexts
-	spi.tx_buf = tx_buf;
-	spi.tx_len = tx_len;
-	spi.rx_buf = rx_buf;
-	spi.rx_len = rx_len;
+	spi.seg = segs;
+	spi.seg_nb = nb;
+	spi.index = 0;
 
 	// set the flag to detect end of transmission
 	spi.fini = KO;
 
 	// start transmission
 	spi.state = NNK_SPI_RUNNING;
-	PORTB &= ~_BV(PB0);	// set /SS low to select slave
-	SPDR = spi.tx_buf[0];
+	nnk_spi_cs_assert();	// select slave
+
+	// short or fast transfer, the ISR would cost more than the bytes
+	if ( (len <= NNK_SPI_POLL_LEN) || ((spi.clock_div <= NNK_SPI_POLL_DIV) && (len <= NNK_SPI_POLL_MAX)) ) {
+		nnk_spi_master_poll();
+		return OK;
+	}
+
+	spi.held = 1;
+	nnk_slp_io_hold();
+	SPDR = ( segs->tx != NULL ) ? segs->tx[0] : 0xff;
 
 	// now the ISR will do the rest of the job
 	return OK;
@@ -342,27 +648,149 @@ u8 nnk_spi_is_fini(void)
 // when using the default call-back, call this function to know if the transfert is OK
 u8 nnk_spi_is_ok(void)
 {
-	return spi.error;
+	return spi.error ? KO : OK;
 }
 
 
-// handle a transmission as slave
+// set the reception buffer as slave
 u8 nnk_spi_slave(u8* rx_buf, u8 rx_len)
 {
+	u8 sreg;
+
 	// check initial conditions
 	if ( (spi.state != NNK_SPI_IDLE) || (spi.behaviour != NNK_SPI_SLAVE) ) {
 		return KO;
 	}
 
+	sreg = SREG;
+	cli();
+
 	// save contexts
-	spi.tx_buf = NULL;
-	spi.tx_len = 0;
 	spi.rx_buf = rx_buf;
 	spi.rx_len = rx_len;
 
-	// start transmission
-	spi.state = NNK_SPI_RUNNING;
+	SREG = sreg;
 
 	// now the ISR will do the rest of the job
 	return OK;
 }
+
+
+// set the response as slave
+u8 nnk_spi_slave_tx(const u8* tx_buf, u8 tx_len)
+{
+	u8 sreg;
+
+	if ( spi.behaviour != NNK_SPI_SLAVE ) {
+		return KO;
+	}
+
+	sreg = SREG;
+	cli();
+
+	// it will be taken at next selection
+	// while the current one may still be sent
+	spi.tx_next_buf = tx_buf;
+	spi.tx_next_len = tx_len;
+
+	// out of a transaction, it is taken at once
+	if ( spi.state != NNK_SPI_RUNNING )
+		nnk_spi_slave_load();
+
+	SREG = sreg;
+
+	return OK;
+}
+
+
+// number of bytes exchanged during the last slave transaction
+u16 nnk_spi_slave_len(void)
+{
+	return spi.index;
+}
+
+
+// /SS edge as slave
+void nnk_spi_slave_ss_edge(void)
+{
+	if ( spi.behaviour != NNK_SPI_SLAVE )
+		return;
+
+	// selected by the master
+	if ( !(PINB & _BV(NNK_SPI_SS)) ) {
+		if ( spi.state == NNK_SPI_RUNNING )
+			return;
+
+		// the first byte of the response is already preloaded
+		spi.index = 0;
+		spi.state = NNK_SPI_RUNNING;
+
+		spi.call_back(NNK_SPI_SLAVE_BEGIN, spi.misc);
+	}
+	// released by the master
+	else {
+		if ( spi.state != NNK_SPI_RUNNING )
+			return;
+
+		// the /SS interrupt has the priority over the one of the last byte
+		if ( SPSR & _BV(SPIF) )
+			nnk_spi_isr();
+
+		nnk_spi_idle();
+		NNK_SPI_STAT_INC(transfers);
+
+		// ready for the next selection
+		nnk_spi_slave_load();
+
+		spi.call_back(NNK_SPI_SLAVE_END, spi.misc);
+	}
+}
+
+
+// get a copy of the counters
+void nnk_spi_stats_get(struct nnk_spi_stats* stats)
+{
+#if NNK_SPI_STATS
+	u8 sreg = SREG;
+	cli();
+
+	*stats = spi.stats;
+
+	SREG = sreg;
+#else
+	stats->bytes = 0;
+	stats->transfers = 0;
+	stats->errors = 0;
+	stats->spurious = 0;
+	stats->isr_max = 0;
+#endif
+}
+
+
+// reset the counters
+void nnk_spi_stats_reset(void)
+{
+#if NNK_SPI_STATS
+	u8 sreg = SREG;
+	cli();
+
+	spi.stats.bytes = 0;
+	spi.stats.transfers = 0;
+	spi.stats.errors = 0;
+	spi.stats.spurious = 0;
+	spi.stats.isr_max = 0;
+
+	SREG = sreg;
+#endif
+}
+
+
+// set the clock used to measure the ISR duration
+void nnk_spi_stats_clock_set(u16 (*clock)(void))
+{
+#if NNK_SPI_STATS
+	spi.clock = clock;
+#else
+	(void)clock;
+#endif
+}
@@ -4,6 +4,43 @@
 # include "type_def.h"
 
 
+//-------------------------------------------
+// defines
+//
+
+// polled fast path
+//
+// a byte costs 8 * divisor CPU cycles on the bus (16 at NNK_SPI_DIV_2)
+// while each SPI interrupt costs its prologue, epilogue and handling on top.
+// so the master transfers are done in a polled loop, without interrupt,
+// when their length is lower or equal to NNK_SPI_POLL_LEN
+// or when the clock divisor is lower or equal to NNK_SPI_POLL_DIV
+// and their length is lower or equal to NNK_SPI_POLL_MAX,
+// so that a long transfer never busy-waits the CPU.
+// in that case, nnk_spi_master() returns when the transfer is done
+// and the call-back is called from the caller context.
+//
+# ifndef NNK_SPI_POLL_LEN
+#  define NNK_SPI_POLL_LEN	2
+# endif
+
+# ifndef NNK_SPI_POLL_DIV
+#  define NNK_SPI_POLL_DIV	NNK_SPI_DIV_4
+# endif
+
+# ifndef NNK_SPI_POLL_MAX
+#  define NNK_SPI_POLL_MAX	16
+# endif
+
+// statistics
+//
+// the counters are compiled in unless NNK_SPI_STATS is defined to 0.
+// they cost a few cycles per byte in the interrupt handler.
+# ifndef NNK_SPI_STATS
+#  define NNK_SPI_STATS	1
+# endif
+
+
 //-------------------------------------------
 // types
 //
@@ -47,7 +84,31 @@ enum nnk_spi_state {
 	NNK_SPI_MASTER_END,
 	NNK_SPI_SLAVE_BEGIN,
 	NNK_SPI_SLAVE_END,
-	NNK_SPI_ERROR
+	NNK_SPI_ERROR,
+	NNK_SPI_QUEUED,		// waiting for the bus (see spi_bus.h)
+};
+
+// scatter-gather segment
+struct nnk_spi_seg {
+	const u8* tx;		// data to send, NULL to send 0xff
+	u8* rx;			// received data, NULL to discard them
+	u8 len;			// number of bytes
+};
+
+// bus statistics
+struct nnk_spi_stats {
+	u32 bytes;		// bytes exchanged
+	u16 transfers;		// master transfers or slave transactions done
+	u16 errors;		// slave reception overruns and write collisions
+	u16 spurious;		// interrupts not awaited
+	u16 isr_max;		// longest interrupt handler in ticks of the stats clock
+};
+
+// chip select
+struct nnk_spi_cs {
+	volatile u8* port;	// PORTx of the pin
+	u8 pin;			// bit of the pin in the port
+	u8 active_high;		// TRUE if the slave is selected by a high level
 };
 
 
@@ -58,23 +119,88 @@ enum nnk_spi_state {
 // set the behaviour and the mode of the SPI block
 extern void nnk_spi_init(enum nnk_spi_behaviour behaviour, enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div);
 
+// set the mode, the data order and the clock of an initialized SPI block
+// return KO if a parameter is invalid, else OK
+extern u8 nnk_spi_config(enum nnk_spi_mode mode, enum nnk_spi_data_order data_order, enum nnk_spi_clock_div clock_div);
+
 // set the SPI clock speed
 extern void nnk_spi_set_clock(enum nnk_spi_clock_div clock_div);
 
+// set a chip select pin as an inactive output
+extern void nnk_spi_cs_init(const struct nnk_spi_cs* cs);
+
+// set the chip select used by the next master transfers (NULL for none)
+// by default, it is PB0 active low.
+// if keep is TRUE, the chip select stays asserted at the end of the transfers,
+// so a sequence of transfers (command, response, data) is done in a single selection
+// till nnk_spi_cs_release() or a new chip select is set.
+// return KO if a transfer is running, else OK
+extern u8 nnk_spi_cs_set(const struct nnk_spi_cs* cs, u8 keep);
+
+// release a chip select kept asserted
+// return KO if a transfer is running, else OK
+extern u8 nnk_spi_cs_release(void);
+
 // set a call-back function and an optional parameter
 extern void nnk_spi_call_back_set(void (*call_back)(enum nnk_spi_state st, void* misc), void* misc);
 
 // transmit and receive data as a master
 // the buffers shall be remained allocated till the end of the transfer
+// short or fast transfers are polled (see NNK_SPI_POLL_LEN)
 extern u8 nnk_spi_master(const u8* const tx_buf, u8 tx_len, u8* const rx_buf, u8 rx_len);
 
+// transmit and receive a list of segments in a single transfer as a master
+// (for instance: command, payload, then CRC read in a discarded segment)
+// the segments and their buffers shall be remained allocated till the end of the transfer
+extern u8 nnk_spi_master_sg(const struct nnk_spi_seg* segs, u8 nb);
+
 // when using the default call-back, call this function to know if the transfert is done
 extern u8 nnk_spi_is_fini(void);
 
 // when using the default call-back, call this function to know if the transfert is OK
+// it returns OK if the last transfer succeeded, KO on error
 extern u8 nnk_spi_is_ok(void);
 
-// receive data as a slave
+// slave mode
+//
+// each transaction is framed by the /SS edges, detected with its pin change interrupt.
+// on /SS falling edge, the call-back is called with NNK_SPI_SLAVE_BEGIN
+// and on rising edge with NNK_SPI_SLAVE_END.
+// the pin change interrupt of /SS is enabled by nnk_spi_init() as slave,
+// its handler shall call nnk_spi_slave_ss_edge().
+// the driver only defines the handler itself when NNK_SPI_SS_ISR is defined at compile time,
+// so that the vector stays free for the applications not using the slave mode.
+//
+
+// set the buffer receiving the data of the next transactions
+// bytes beyond rx_len are discarded
 extern u8 nnk_spi_slave(u8* const rx_buf, u8 rx_len);
 
+// set the response of the next transaction
+// the current response is being sent till the end of the current transaction,
+// so the next one can be prepared meanwhile (double buffering).
+// once sent, the response is sent again by the next transactions till a new one is set.
+// the bytes beyond tx_len are sent as 0xff.
+// the first byte is preloaded at the end of the previous transaction
+// (or at once out of a transaction), so the master can clock as soon as it selects.
+extern u8 nnk_spi_slave_tx(const u8* tx_buf, u8 tx_len);
+
+// number of bytes exchanged during the current or last slave transaction
+extern u16 nnk_spi_slave_len(void);
+
+// to be called on /SS edges
+extern void nnk_spi_slave_ss_edge(void);
+
+// statistics
+//
+// get a copy of the counters (all zeroed if NNK_SPI_STATS is 0)
+extern void nnk_spi_stats_get(struct nnk_spi_stats* stats);
+
+// reset the counters
+extern void nnk_spi_stats_reset(void);
+
+// set the clock used to measure the interrupt handler duration (NULL to stop)
+// it shall be cheap, for instance reading TCNT1 of a free running timer1
+extern void nnk_spi_stats_clock_set(u16 (*clock)(void));
+
 #endif	// __NNK_SPI_H__
@@ -0,0 +1,188 @@
+#include "spi_bus.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>	// cli()
+
+//-------------------------------------------
+// private variables
+//
+
+static struct {
+	// queued transfers, the head one is running
+	struct nnk_spi_xfer* head;
+	struct nnk_spi_xfer* tail;
+
+	// device the bus is configured for
+	const struct nnk_spi_dev* dev;
+
+	// transfers being started
+	u8 starting;
+} bus;
+
+
+//-------------------------------------------
+// private functions
+//
+
+static void nnk_spi_bus_call_back(enum nnk_spi_state st, void* misc);
+
+// start the transfers at the head of the queue
+static void nnk_spi_bus_start(void)
+{
+	struct nnk_spi_xfer* xfer;
+	const struct nnk_spi_dev* dev;
+	u8 sreg;
+	u8 ok;
+
+	// polled transfers end inside nnk_spi_master()
+	// so the following ones are started by the loop below
+	// rather than recursively from the call-back
+	sreg = SREG;
+	cli();
+	if ( bus.starting ) {
+		SREG = sreg;
+		return;
+	}
+	bus.starting = 1;
+	SREG = sreg;
+
+	while ( 1 ) {
+		sreg = SREG;
+		cli();
+
+		// nothing more to start
+		// checked with the flag release so a transfer ended
+		// by the ISR meanwhile is not left in the queue
+		xfer = bus.head;
+		if ( (xfer == NULL) || (xfer->state != NNK_SPI_QUEUED) ) {
+			bus.starting = 0;
+			SREG = sreg;
+			break;
+		}
+
+		xfer->state = NNK_SPI_RUNNING;
+		SREG = sreg;
+
+		// the transfer itself runs with the interrupts enabled
+		dev = xfer->dev;
+
+		// reconfigure the bus only when the device changes
+		if ( dev != bus.dev ) {
+			nnk_spi_config(dev->mode, dev->data_order, dev->clock_div);
+			bus.dev = dev;
+		}
+
+		// the SPI driver selects the device
+		nnk_spi_cs_set(&dev->cs, xfer->keep_cs);
+
+		// if the SPI refuses it, end it on error
+		if ( xfer->segs != NULL )
+			ok = nnk_spi_master_sg(xfer->segs, xfer->nb_segs);
+		else
+			ok = nnk_spi_master(xfer->tx_buf, xfer->tx_len, xfer->rx_buf, xfer->rx_len);
+		if ( ok == KO )
+			nnk_spi_bus_call_back(NNK_SPI_ERROR, NULL);
+	}
+}
+
+
+// end of transfer, called from the SPI ISR or at the end of a polled transfer
+static void nnk_spi_bus_call_back(enum nnk_spi_state st, void* misc)
+{
+	struct nnk_spi_xfer* xfer;
+	u8 sreg;
+
+	(void)misc;
+
+	// polled transfers end out of ISR, while a submit may occur
+	sreg = SREG;
+	cli();
+
+	xfer = bus.head;
+	if ( xfer == NULL ) {
+		SREG = sreg;
+		return;
+	}
+
+	// remove the transfer from the queue
+	bus.head = xfer->next;
+	if ( bus.head == NULL )
+		bus.tail = NULL;
+
+	SREG = sreg;
+
+	xfer->state = st;
+	if ( xfer->call_back != NULL )
+		xfer->call_back(st, xfer->misc);
+
+	// start the next one without going back to the main loop
+	if ( bus.head != NULL )
+		nnk_spi_bus_start();
+}
+
+
+//-------------------------------------------
+// public functions
+//
+
+void nnk_spi_bus_init(void)
+{
+	nnk_spi_init(NNK_SPI_MASTER, NNK_SPI_ZERO, NNK_SPI_MSB, NNK_SPI_DIV_4);
+	nnk_spi_call_back_set(nnk_spi_bus_call_back, NULL);
+
+	bus.head = NULL;
+	bus.tail = NULL;
+	bus.dev = NULL;
+	bus.starting = 0;
+}
+
+
+void nnk_spi_bus_dev_init(const struct nnk_spi_dev* dev)
+{
+	nnk_spi_cs_init(&dev->cs);
+}
+
+
+u8 nnk_spi_bus_submit(struct nnk_spi_xfer* xfer)
+{
+	u8 sreg;
+	u8 idle;
+
+	// already queued or running
+	if ( (xfer->state == NNK_SPI_RUNNING) || (xfer->state == NNK_SPI_QUEUED) )
+		return KO;
+
+	xfer->state = NNK_SPI_QUEUED;
+	xfer->next = NULL;
+
+	sreg = SREG;
+	cli();
+
+	// append it
+	idle = (bus.tail == NULL);
+	if ( idle )
+		bus.head = xfer;
+	else
+		bus.tail->next = xfer;
+	bus.tail = xfer;
+
+	SREG = sreg;
+
+	// bus is idle, start at once
+	if ( idle )
+		nnk_spi_bus_start();
+
+	return OK;
+}
+
+
+u8 nnk_spi_bus_is_fini(const struct nnk_spi_xfer* xfer)
+{
+	return ( (xfer->state == NNK_SPI_MASTER_END) || (xfer->state == NNK_SPI_ERROR) ) ? OK : KO;
+}
+
+
+u8 nnk_spi_bus_is_ok(const struct nnk_spi_xfer* xfer)
+{
+	return ( xfer->state == NNK_SPI_MASTER_END ) ? OK : KO;
+}
@@ -0,0 +1,88 @@
+#ifndef __NNK_SPI_BUS_H__
+#define __NNK_SPI_BUS_H__
+
+# include "type_def.h"
+# include "drivers/spi.h"
+
+//
+// transaction layer sharing the SPI bus between several devices
+//
+// each device describes its SPI settings and its chip select pin.
+// the transfers are queued and executed back-to-back by the SPI ISR,
+// the bus being reconfigured for each device.
+//
+
+//-------------------------------------------
+// types
+//
+
+// a device on the bus
+struct nnk_spi_dev {
+	enum nnk_spi_mode mode;
+	enum nnk_spi_data_order data_order;
+	enum nnk_spi_clock_div clock_div;
+
+	struct nnk_spi_cs cs;	// chip select
+};
+
+// a transfer to or from a device
+// the descriptor and its buffers belong to the caller
+// and shall remain allocated till the end of the transfer
+// the descriptor shall be zeroed (static or = { 0 }) before its first submit,
+// as its private state tells if it is already queued
+struct nnk_spi_xfer {
+	const struct nnk_spi_dev* dev;
+
+	const u8* tx_buf;
+	u8 tx_len;
+	u8* rx_buf;
+	u8 rx_len;
+
+	// if not NULL, the segments are used instead of the buffers
+	const struct nnk_spi_seg* segs;
+	u8 nb_segs;
+
+	// keep the chip select asserted after the transfer
+	// till a transfer to another device or nnk_spi_cs_release()
+	u8 keep_cs;
+
+	// optional call-back called from ISR at the end of the transfer
+	// with NNK_SPI_MASTER_END or NNK_SPI_ERROR
+	void (*call_back)(enum nnk_spi_state st, void* misc);
+	void* misc;
+
+	// private
+	volatile enum nnk_spi_state state;
+	struct nnk_spi_xfer* next;
+};
+
+
+//-------------------------------------------
+// public functions
+//
+
+// init the SPI block as master for the bus
+extern void nnk_spi_bus_init(void);
+
+// set the chip select of a device as an inactive output
+extern void nnk_spi_bus_dev_init(const struct nnk_spi_dev* dev);
+
+// queue a transfer
+// it is started at once if the bus is idle,
+// a polled transfer then runs before the return, interrupts enabled
+// return KO if the transfer is already queued, else OK
+extern u8 nnk_spi_bus_submit(struct nnk_spi_xfer* xfer);
+
+// check if the transfer is done
+extern u8 nnk_spi_bus_is_fini(const struct nnk_spi_xfer* xfer);
+
+// check if the transfer is OK
+extern u8 nnk_spi_bus_is_ok(const struct nnk_spi_xfer* xfer);
+
+
+# ifdef __PT_H__
+#  define PT_SPI_BUS_WAIT(pt, xfer)			\
+	PT_WAIT_UNTIL((pt), nnk_spi_bus_is_fini(xfer))
+# endif	// __PT_H__
+
+#endif	// __NNK_SPI_BUS_H__
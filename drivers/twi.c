@@ -20,10 +20,11 @@
 //
 
 #include "twi.h"
+#include "sleep.h"
 
 #include <compat/twi.h>
-#include <avr/pgmspace.h>
 #include <avr/interrupt.h>	// ISR()
+#include <util/delay.h>		// _delay_us()
 
 
 #define NNK_TWI_PRESCALER_1		0x00
@@ -34,6 +35,23 @@
 #define NNK_TWI_ACK			1
 #define NNK_TWI_NACK		0
 
+// TWI pins
+#if defined(__AVR_ATmega48__) || defined(__AVR_ATmega88__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__)
+# define NNK_TWI_SDA		PC4
+# define NNK_TWI_SCL		PC5
+#else	// ATmega164/324/644/1284
+# define NNK_TWI_SDA		PC1
+# define NNK_TWI_SCL		PC0
+#endif
+
+// half period of the recovery clock in micro-seconds (100 kHz)
+#define NNK_TWI_RECOVER_DELAY	5
+
+// profiled status: TWI status 0x00 to 0xc8, then no info and unknown status
+#define NNK_TWI_IDX_NO_INFO	((TW_ST_LAST_DATA >> 3) + 1)
+#define NNK_TWI_IDX_OTHER	((TW_ST_LAST_DATA >> 3) + 2)
+#define NNK_TWI_NB_STATUS	((TW_ST_LAST_DATA >> 3) + 3)
+
 //-------------------
 // private variables
 //
@@ -53,6 +71,43 @@ static volatile struct {
         // pointer to function to be called on
         // transfert events or on error
         void* misc;		// a miscellaneous pointer (can hold what ever you want)
+
+        u16 bitrate;		// bit rate settings of the single comms
+
+        // watchdog and retries
+        u32 last;		// time of the last master comm start or state change
+        u8 owner;		// this node is master on the bus
+        u32 retry_time;		// time of the lost arbitration
+        u8 retries;		// number of retries of the current master comm
+        u8 retry;		// a retry is waiting for its backoff
+
+        struct nnk_twi_stats stats;
+
+#if NNK_TWI_PROFILE
+        // time spent in each status
+        struct nnk_twi_prof prof[NNK_TWI_NB_STATUS];
+        u16 (*prof_clock)(void);
+#endif
+
+        // queued transactions
+        struct nnk_twi_xfer* cur;	// transaction using the bus
+        const struct nnk_twi_seg* seg;	// its current segment
+        u8 seg_nb;			// segments left including the current one
+        struct nnk_twi_xfer* head;	// waiting transactions
+        struct nnk_twi_xfer* tail;
+
+        // register bank slave
+        u8* regs[2];		// front and back banks, regs[0] NULL when unused
+        u8 regs_front;		// index of the bank seen by the master
+        u8 regs_len;		// number of registers
+        u8 regs_ptr;		// register pointer
+        u8 regs_wr;		// number of bytes written by the master, pointer included
+        u8 regs_swap;		// back bank to be swapped at the end of the slave transaction
+        u8 regs_chg;		// registers changed since last poll
+        u8 regs_chg_first;
+        u8 regs_chg_last;
+        void (*regs_changed)(const u8* regs, u8 first, u8 len, void* misc);
+        void* regs_misc;
 } twi;
 
 //-------------------
@@ -70,6 +125,32 @@ static void nnk_twi_default_call_back(enum nnk_twi_state state, u8 nb_data, void
         nnk_twi_stop();
 }
 
+// the bus ownership limits the sleep to idle until it is released
+static void nnk_twi_owner_set(u8 owner)
+{
+        if ( owner && !twi.owner )
+                nnk_slp_io_hold();
+        else if ( !owner && twi.owner )
+                nnk_slp_io_release();
+
+        twi.owner = owner;
+}
+
+// SDA held low by a slave while the bus should be free
+// it is sampled during a byte time, a running comm having some high bits
+static u8 nnk_twi_sda_stuck(void)
+{
+        u8 i;
+
+        for ( i = 0; i < 9; i++ ) {
+                if ( PINC & _BV(NNK_TWI_SDA) )
+                        return 0;
+                _delay_us(2 * NNK_TWI_RECOVER_DELAY);
+        }
+
+        return 1;
+}
+
 static void nnk_twi_start(void)
 {
 
@@ -106,111 +187,218 @@ static void nnk_twi_write(u8 data, u8 ack)
         }
 }
 
-static void nnk_twi_call_back_call(enum nnk_twi_state state)
+// prepare the master comm of the current segment
+static void nnk_twi_seg_load(void)
 {
-        twi.state = state;
-        (*twi.call_back)(state, twi.nb_data, twi.misc);
+        const struct nnk_twi_seg* seg = twi.seg;
+
+        twi.ms_buf = seg->buf;
+        twi.ms_buf_len = seg->len;
+
+        if ( seg->dir == NNK_TWI_READ ) {
+                twi.addr = (twi.cur->addr << 1) | TW_READ;
+                twi.state = NNK_TWI_MS_RX_BEGIN;
+        }
+        else {
+                twi.addr = (twi.cur->addr << 1) | TW_WRITE;
+                twi.state = NNK_TWI_MS_TX_BEGIN;
+        }
 }
 
-// TWI_isr
-ISR(TWI_vect)
+// check if the bus speed settings are the current ones
+static u8 nnk_twi_rate_is(u16 bitrate)
 {
-        static const void* const status_action[] PROGMEM = {
-                &&_TW_BUS_ERROR,		// 0x00
-                &&_TW_START,			// 0x08
-                &&_TW_REP_START,		// 0x10
-                &&_TW_MT_SLA_ACK,		// 0x18
-                &&_TW_MT_SLA_NACK,		// 0x20
-                &&_TW_MT_DATA_ACK,		// 0x28
-                &&_TW_MT_DATA_NACK,		// 0x30
-                // &&_TW_MT_ARB_LOST,		// 0x38
-                &&_TW_MR_ARB_LOST,		// 0x38
-                &&_TW_MR_SLA_ACK,		// 0x40
-                &&_TW_MR_SLA_NACK,		// 0x48
-                &&_TW_MR_DATA_ACK,		// 0x50
-                &&_TW_MR_DATA_NACK,		// 0x58
-                &&_TW_SR_SLA_ACK,		// 0x60
-                &&_TW_SR_ARB_LOST_SLA_ACK,	// 0x68
-                &&_TW_SR_GCALL_ACK,		// 0x70
-                &&_TW_SR_ARB_LOST_GCALL_ACK,	// 0x78
-                &&_TW_SR_DATA_ACK,		// 0x80
-                &&_TW_SR_DATA_NACK,		// 0x88
-                &&_TW_SR_GCALL_DATA_ACK,	// 0x90
-                &&_TW_SR_GCALL_DATA_NACK,	// 0x98
-                &&_TW_SR_STOP,			// 0xa0
-                &&_TW_ST_SLA_ACK,		// 0xa8
-                &&_TW_ST_ARB_LOST_SLA_ACK,	// 0xb0
-                &&_TW_ST_DATA_ACK,		// 0xb8
-                &&_TW_ST_DATA_NACK,		// 0xc0
-                &&_TW_ST_LAST_DATA,		// 0xc8
-        };
+        return ( (TWBR == (u8)bitrate) && ((TWSR & 0x03) == (bitrate >> 8)) ) ? OK : KO;
+}
 
-        u8 buf;
-        void* action;
+// program the bus speed settings of the next comm
+static void nnk_twi_rate_apply(u16 bitrate)
+{
+        TWBR = (u8)bitrate;
+        TWSR = bitrate >> 8;
+}
 
-        // check status
-        buf = TW_STATUS;
+// restart the current queued transaction from its first segment
+// so that its repeated starts stay atomic after an arbitration loss
+static void nnk_twi_xfer_rewind(void)
+{
+        twi.seg = twi.cur->segs;
+        twi.seg_nb = twi.cur->nb_segs;
+        twi.cur->nb_data = 0;
+        nnk_twi_seg_load();
+}
 
-        if ( buf == TW_NO_INFO )	// 0xf8
-                goto _TW_NO_INFO;
+// start the next waiting transaction if any
+static void nnk_twi_xfer_next(void)
+{
+        struct nnk_twi_xfer* xfer = twi.head;
+        u16 bitrate;
+
+        if ( xfer == NULL )
+                return;
+
+        // switch to its bus speed, but not while the previous STOP is pending
+        // as it would be generated at the new speed,
+        // in this case the transaction is started by nnk_twi_poll()
+        bitrate = ( xfer->rate != 0 ) ? xfer->bitrate : twi.bitrate;
+        if ( nnk_twi_rate_is(bitrate) == KO ) {
+                if ( TWCR & _BV(TWSTO) )
+                        return;
+                nnk_twi_rate_apply(bitrate);
+        }
 
-        if ( buf > TW_ST_LAST_DATA )	// unknown value
-                goto other;
+        // dequeue it
+        twi.head = xfer->next;
+        if ( twi.head == NULL )
+                twi.tail = NULL;
 
-        // the TWI status is only the 5 MSB bits of the register
-        // shifting it, makes it fit the jump table 
-        buf = buf >> 3;
+        twi.cur = xfer;
+        twi.seg = xfer->segs;
+        twi.seg_nb = xfer->nb_segs;
+        nnk_twi_seg_load();
 
-        // jump to the routine associated to the TWI status
-        // goto *status_action[buf]; can't be done directly, since the table is in flash
-        action = (void*)pgm_read_word(&(status_action[buf]));
-        goto *action;
+        // arm the watchdog
+        twi.last = nnk_time_get();
+        twi.retries = 0;
+        twi.retry = 0;
 
-        // Master
-_TW_START:			// 0x08 : start
-_TW_REP_START:			// 0x10 : repeated start
-        // start or restart correctly generated
+        // generate a START as soon as the bus is free
+        // keeping a STOP still pending
+        TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE) | (TWCR & _BV(TWSTO));
+}
 
-        // reset nb_data to zero
-        twi.nb_data = 0;
+// end of a segment of the current queued transaction
+static void nnk_twi_xfer_step(enum nnk_twi_state state)
+{
+        struct nnk_twi_xfer* xfer = twi.cur;
+
+        xfer->nb_data += twi.nb_data;
+
+        // a write cut short by the slave
+        if ( (state == NNK_TWI_MS_TX_END) && (twi.nb_data < twi.seg->len) )
+                state = NNK_TWI_ERROR;
+
+        // go on with the next segment after a repeated start
+        if ( (state == NNK_TWI_MS_TX_END) || (state == NNK_TWI_MS_RX_END) ) {
+                twi.seg_nb--;
+                if ( twi.seg_nb != 0 ) {
+                        twi.seg++;
+                        nnk_twi_seg_load();
+                        twi.last = nnk_time_get();
+                        TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+                        return;
+                }
+        }
 
-        // send slave addr
-        nnk_twi_write(twi.addr, OK);
-        return;
+        // the transaction is finished, release the bus if still master on it
+        // (after an arbitration loss or an error, it is already released)
+        // the bus speed is only changed when the next comm starts
+        if ( twi.owner ) {
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWSTO) | _BV(TWIE);
+                nnk_twi_owner_set(0);
+        }
 
-        // -----------------------------------------------------------------------
-        // Master transmitter
-_TW_MT_SLA_ACK:			// 0x18 : slave addr ack
-        // slave present and ready to receive
+        twi.ms_buf_len = 0;
+        twi.state = NNK_TWI_IDLE;
+        twi.cur = NULL;
 
-        // if more data to send
-        if ( twi.nb_data < twi.ms_buf_len ) {
-                buf = twi.nb_data;
-                twi.nb_data++;
-                nnk_twi_write( *(twi.ms_buf + buf), OK);
+        // chain the next one
+        nnk_twi_xfer_next();
+
+        // signal it to its owner
+        xfer->state = state;
+        if ( xfer->call_back != NULL )
+                xfer->call_back(state, xfer->nb_data, xfer->misc);
+}
+
+// end of a slave transaction in register bank mode
+static void nnk_twi_regs_end(void)
+{
+        // publish the back bank
+        if ( twi.regs_swap ) {
+                twi.regs_front ^= 1;
+                twi.regs_swap = 0;
+        }
+
+        twi.state = NNK_TWI_IDLE;
+
+        // if we have data to send or read as master
+        if ( (twi.cur != NULL) || (twi.ms_buf_len != 0) ) {
+                // resume the segment of the queued transaction
+                if ( twi.cur != NULL )
+                        nnk_twi_seg_load();
+
+                // generate a restart
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
         }
-        // else transmission is finish
         else {
-                // reset len to prevent data resending
-                twi.ms_buf_len = 0;
+                // give up bus control, wait for next start
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
 
-                nnk_twi_call_back_call(NNK_TWI_MS_TX_END);
+                // maybe a waiting queued transaction
+                nnk_twi_xfer_next();
         }
+}
 
-        return;
+// byte written by the master in register bank mode
+static void nnk_twi_regs_rx(u8 data)
+{
+        u8 ptr;
 
-_TW_MT_SLA_NACK:		// 0x20 : slave addr nack
-        // slave not present at given address
+        // the first byte is the register pointer
+        if ( twi.regs_wr == 0 ) {
+                twi.regs_ptr = data;
+                twi.regs_wr = 1;
+                return;
+        }
 
-        // reset len to prevent data resending
-        twi.ms_buf_len = 0;
+        // the next ones are written from it, the ones beyond the bank are discarded
+        ptr = twi.regs_ptr;
+        if ( ptr >= twi.regs_len )
+                return;
 
-        nnk_twi_call_back_call(NNK_TWI_NO_SL);
+        twi.regs[twi.regs_front][ptr] = data;
+        twi.regs_ptr = ptr + 1;
+        twi.regs_wr++;
+
+        // remember the changed registers for the main loop
+        if ( !twi.regs_chg ) {
+                twi.regs_chg_first = ptr;
+                twi.regs_chg_last = ptr;
+                twi.regs_chg = 1;
+        }
+        else if ( ptr < twi.regs_chg_first )
+                twi.regs_chg_first = ptr;
+        else if ( ptr > twi.regs_chg_last )
+                twi.regs_chg_last = ptr;
+}
+
+static void nnk_twi_call_back_call(enum nnk_twi_state state)
+{
+        // feed the watchdog
+        twi.last = nnk_time_get();
 
-        return;
+        // the end of a queued transaction segment is handled by the driver
+        if ( (twi.cur != NULL) && ( (state == NNK_TWI_MS_TX_END) || (state == NNK_TWI_MS_RX_END) || (state == NNK_TWI_NO_SL) || (state == NNK_TWI_ERROR) ) ) {
+                nnk_twi_xfer_step(state);
+                return;
+        }
 
-_TW_MT_DATA_ACK:		// 0x28 : slave data ack
-        // slave can receive more data
+        twi.state = state;
+        (*twi.call_back)(state, twi.nb_data, twi.misc);
+}
+
+//-------------------
+// status handlers
+//
+// each handler processes one or several TWI status
+// the common paths are shared between the handlers
+//
+
+// send next data as master or signal the end of transmission
+static inline void nnk_twi_ms_tx_next(void)
+{
+        u8 buf;
 
         // if more data to send
         if ( twi.nb_data < twi.ms_buf_len ) {
@@ -225,251 +413,296 @@ _TW_MT_DATA_ACK:		// 0x28 : slave data ack
 
                 nnk_twi_call_back_call(NNK_TWI_MS_TX_END);
         }
+}
 
-        return;
-
-_TW_MT_DATA_NACK:		// 0x30 : slave data nack
-        // transmission finish from slave point of view or slave disconnected
+// ack the next data as master receiver unless it is the last one
+static inline void nnk_twi_ms_rx_ack(void)
+{
+        // if more data to receive
+        if ( (twi.nb_data + 1) < twi.ms_buf_len )
+                nnk_twi_ack();
+        // else nack the next data as it is the last one
+        else
+                nnk_twi_nack();
+}
 
-        // reset len to prevent data resending
-        twi.ms_buf_len = 0;
+// store the data received as master
+static inline void nnk_twi_ms_rx_store(void)
+{
+        *(twi.ms_buf + twi.nb_data) = nnk_twi_read();
+        twi.nb_data++;
+}
 
-        // signal it to the application
-        nnk_twi_call_back_call(NNK_TWI_MS_TX_END);
+// send next data as slave or a dummy value
+static inline void nnk_twi_sl_tx_next(void)
+{
+        u8 buf;
 
-        return;
+        // send data if any
+        if ( twi.nb_data < twi.sl_buf_len ) {
+                buf = twi.nb_data;
+                twi.nb_data++;
+                nnk_twi_write( *(twi.sl_buf + buf), OK);
+        }
+        else {	// send dummy value
+                nnk_twi_write(0x33, KO);
+        }
+}
 
-        //	_TW_MT_ARB_LOST: // same value and same action as following case
+// ack the next data as slave receiver unless it is the last one
+static inline void nnk_twi_sl_rx_ack(void)
+{
+        // if more data to receive
+        if ( (twi.nb_data + 1) < twi.sl_buf_len )
+                nnk_twi_ack();
+        // else about to receive the last data
+        else
+                nnk_twi_nack();
+}
 
-        // -----------------------------------------------------------------------
-        // Master receiver
-_TW_MR_ARB_LOST:		// 0x38 : arbitration lost
-        // arbitration lost
+// store the data received as slave
+static inline void nnk_twi_sl_rx_store(void)
+{
+        *(twi.sl_buf + twi.nb_data) = nnk_twi_read();
+        twi.nb_data++;
+}
 
-        // retry to generate a START when the bus becomes free
-        TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+// 0x00 : internal protocol violation
+static inline void nnk_twi_bus_error(void)
+{
+        // recover releasing the bus
+        TWCR = _BV(TWEA) | _BV(TWINT) | _BV(TWEN) | _BV(TWSTO) | _BV(TWIE);
+        nnk_twi_owner_set(0);
+        twi.stats.bus_errors++;
 
-        return;
+        // a slave disturbed by the error may still hold SDA
+        if ( nnk_twi_sda_stuck() )
+                nnk_twi_recover();
 
-_TW_MR_SLA_ACK:			// 0x40 : slave addr ack
-        // slave present and ready to send
+        twi.ms_buf_len = 0;
+        nnk_twi_call_back_call(NNK_TWI_ERROR);
+}
 
-        // if more than 1 data to received
-        if ( (twi.nb_data + 1) < twi.ms_buf_len ) {
-                nnk_twi_ack();
-        }
-        // else nack the next data as it is the only one
-        else {
-                nnk_twi_nack();
-        }
+// 0x08 : start
+// 0x10 : repeated start
+static inline void nnk_twi_started(void)
+{
+        // the bus is ours till the STOP or an arbitration loss
+        nnk_twi_owner_set(1);
 
-        return;
+        // reset nb_data to zero
+        twi.nb_data = 0;
 
-_TW_MR_SLA_NACK:		// 0x48 : slave addr nack
-        // slave not present
+        // send slave addr
+        nnk_twi_write(twi.addr, OK);
+}
 
+// 0x20 : slave addr + W nack
+// 0x48 : slave addr + R nack
+static inline void nnk_twi_no_sl(void)
+{
         // reset len to prevent data resending
         twi.ms_buf_len = 0;
+        twi.stats.no_slave++;
 
-        // signal it to the application
         nnk_twi_call_back_call(NNK_TWI_NO_SL);
+}
 
-        return;
-
-_TW_MR_DATA_ACK:		// 0x50 : slave data ack
-        // one more byte received from slave
-
-        // store it
-        *(twi.ms_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
-
-        // if more data to receive
-        if ( (twi.nb_data + 1) < twi.ms_buf_len ) {
-                nnk_twi_ack();
-        }
-        // else about to receive the last data
-        else {
-                nnk_twi_nack();
-        }
-
-        return;
-
-_TW_MR_DATA_NACK:		// 0x58 : slave data nack
-        // last byte received
-
-        // store it
-        *(twi.ms_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
+// 0x30 : slave data nack
+static inline void nnk_twi_mt_data_nack(void)
+{
+        // transmission finish from slave point of view or slave disconnected
 
         // reset len to prevent data resending
         twi.ms_buf_len = 0;
 
-        // no more data to read (reception finished)
-        nnk_twi_call_back_call(NNK_TWI_MS_RX_END);
-
-        return;
-
-        // -----------------------------------------------------------------------
-        // Slave transmitter
-_TW_ST_SLA_ACK:			// 0xa8 : own slave addr + R
-_TW_ST_ARB_LOST_SLA_ACK:	// 0xb0 : arb lost as master, own slave addr + R
-        // adressed as slave (whether or not the arbitration was lost)
+        // signal it to the application
+        nnk_twi_call_back_call(NNK_TWI_MS_TX_END);
+}
 
-        // reset nb_data to zero
-        twi.nb_data = 0;
+// 0x38 : arbitration lost
+static inline void nnk_twi_arb_lost(void)
+{
+        nnk_twi_owner_set(0);
+        twi.stats.arb_lost++;
 
-        // need support from application
-        // a buffer to transmit shall be provided
-        nnk_twi_call_back_call(NNK_TWI_SL_TX_BEGIN);
+        // too many retries, give up
+        if ( twi.retries >= NNK_TWI_RETRIES ) {
+                twi.ms_buf_len = 0;
+                twi.stats.failures++;
 
-        // send data if any
-        if ( twi.nb_data < twi.sl_buf_len ) {
-                buf = twi.nb_data;
-                twi.nb_data++;
-                nnk_twi_write( *(twi.sl_buf + buf), OK);
-        }
-        else {	// send dummy value
-                nnk_twi_write(0x33, KO);
-        }
+                // release the bus
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
 
-        return;
+                // the lost arbitrations may be due to a slave holding SDA
+                if ( nnk_twi_sda_stuck() )
+                        nnk_twi_recover();
 
-_TW_ST_DATA_ACK:		// 0xb8 : byte transmit, ack received
-        // byte sent to the master and it wants more
+                nnk_twi_call_back_call(NNK_TWI_ERROR);
 
-        // send data if any
-        if ( twi.nb_data < twi.sl_buf_len ) {
-                buf = twi.nb_data;
-                twi.nb_data++;
-                nnk_twi_write( *(twi.sl_buf + buf), OK);
-        }
-        else {	// send dummy value
-                nnk_twi_write(0x33, KO);
+                return;
         }
+        twi.retries++;
 
-        return;
+        // a queued transaction is restarted from its first segment
+        if ( twi.cur != NULL )
+                nnk_twi_xfer_rewind();
 
-_TW_ST_DATA_NACK:		// 0xc0 : byte transmit, nack received
-_TW_ST_LAST_DATA:		// 0xc8 : last data transmit, ack received
-        // master nack, so tx is finished
-
-        // signal it to the application
-        nnk_twi_call_back_call(NNK_TWI_SL_TX_END);
-
-        // if we have data to send or receive as master
-        if (twi.ms_buf_len != 0) {
-                // generate a restart
-                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+        // retry to generate a START when the bus becomes free
+        if ( NNK_TWI_BACKOFF == 0 ) {
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
         }
+        // or after the backoff, see nnk_twi_poll()
         else {
-                // give up bus control, wait for next start
                 TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
-                twi.state = NNK_TWI_IDLE;
+                twi.retry_time = nnk_time_get();
+                twi.retry = 1;
         }
+}
 
-        return;
+// 0x50 : data received, ack sent
+static inline void nnk_twi_mr_data_ack(void)
+{
+        nnk_twi_ms_rx_store();
+        nnk_twi_ms_rx_ack();
+}
 
-        // -----------------------------------------------------------------------
-        // Slave reveicer
-_TW_SR_SLA_ACK:			// 0x60 : own slave addr + W
-_TW_SR_ARB_LOST_SLA_ACK:	// 0x68 : arb lost, own slave addr +W
-        // addressed as slave for rx (whether or not the arbitration was lost)
+// 0x58 : data received, nack sent
+static inline void nnk_twi_mr_data_nack(void)
+{
+        // last byte received
+        nnk_twi_ms_rx_store();
 
+        // reset len to prevent data resending
+        twi.ms_buf_len = 0;
+
+        // no more data to read (reception finished)
+        nnk_twi_call_back_call(NNK_TWI_MS_RX_END);
+}
+
+// 0x60 : own slave addr + W
+// 0x68 : arb lost, own slave addr + W
+static inline void nnk_twi_sr_sla_ack(void)
+{
         // reset nb_data to zero
         twi.nb_data = 0;
 
+        // register bank mode, the pointer comes first
+        if ( twi.regs[0] != NULL ) {
+                twi.state = NNK_TWI_SL_RX_BEGIN;
+                twi.regs_wr = 0;
+                nnk_twi_ack();
+                return;
+        }
+
         // need support from application
         // a buffer to received the data shall be provided
         nnk_twi_call_back_call(NNK_TWI_SL_RX_BEGIN);
+        nnk_twi_sl_rx_ack();
+}
 
-        // if more data to receive
-        if ( (twi.nb_data + 1) < twi.sl_buf_len )
-                nnk_twi_ack();
-        // else about to receive the last data
-        else
-                nnk_twi_nack();
+// 0x68 : arb lost, own slave addr + W
+// 0x78 : arb lost, gen call received, ack sent
+// 0xb0 : arb lost as master, own slave addr + R
+static inline void nnk_twi_sl_arb_lost(void)
+{
+        nnk_twi_owner_set(0);
 
-        return;
+        // the master comm is resumed at the end of the slave one,
+        // a queued transaction from its first segment
+        if ( twi.cur != NULL )
+                nnk_twi_xfer_rewind();
+}
 
-_TW_SR_GCALL_ACK:		// 0x70 : gen call received, ack sent
-_TW_SR_ARB_LOST_GCALL_ACK:	// 0x78 : arb lost + idem above
-        // general call received (whether or not the arbitration was lost)
+static inline void nnk_twi_sr_sla_arb(void)
+{
+        nnk_twi_sl_arb_lost();
+        nnk_twi_sr_sla_ack();
+}
 
+// 0x70 : gen call received, ack sent
+// 0x78 : arb lost, gen call received, ack sent
+static inline void nnk_twi_sr_gcall_ack(void)
+{
         // reset nb_data to zero
         twi.nb_data = 0;
 
         // need support from application
         // a buffer to received the data shall be provided
         nnk_twi_call_back_call(NNK_TWI_GENCALL_BEGIN);
+        nnk_twi_sl_rx_ack();
+}
 
-        // if more data to receive
-        if ( (twi.nb_data + 1) < twi.sl_buf_len )
-                nnk_twi_ack();
-        // else about to receive the last data
-        else
-                nnk_twi_nack();
-
-        return;
-
-_TW_SR_DATA_ACK:		// 0x80 : data received, ack sent
-        // one more byte received and more to come
+static inline void nnk_twi_sr_gcall_arb(void)
+{
+        nnk_twi_sl_arb_lost();
+        nnk_twi_sr_gcall_ack();
+}
 
-        // store it
-        *(twi.sl_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
+// 0x80 : data received, ack sent
+static inline void nnk_twi_sr_data_ack(void)
+{
+        // register bank mode, nack the bytes beyond the bank
+        if ( twi.regs[0] != NULL ) {
+                nnk_twi_regs_rx(nnk_twi_read());
+                if ( twi.regs_ptr < twi.regs_len )
+                        nnk_twi_ack();
+                else
+                        nnk_twi_nack();
+                return;
+        }
 
-        // if more data to receive
-        if ( (twi.nb_data + 1) < twi.sl_buf_len )
-                nnk_twi_ack();
-        // else about to receive the last data
-        else
-                nnk_twi_nack();
+        nnk_twi_sl_rx_store();
+        nnk_twi_sl_rx_ack();
+}
 
-        return;
+// 0x88 : data received, nack sent
+static inline void nnk_twi_sr_data_nack(void)
+{
+        // register bank mode, discard it
+        // no stop will be signaled as the slave is no more addressed
+        if ( twi.regs[0] != NULL ) {
+                (void)nnk_twi_read();
+                nnk_twi_regs_end();
+                return;
+        }
 
-_TW_SR_DATA_NACK:		// 0x88 : data received, nack sent
         // last byte received
-
-        // store it
-        *(twi.sl_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
+        nnk_twi_sl_rx_store();
 
         // signal end of rx
         nnk_twi_call_back_call(NNK_TWI_SL_RX_END);
+}
 
-        return;
-
-_TW_SR_GCALL_DATA_ACK:		// 0x90 : in gen call, data received, ack sent
-        // one more byte received and more to come
-
-        // store it
-        *(twi.sl_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
-
-        // if more data to receive
-        if ( (twi.nb_data + 1) < twi.sl_buf_len )
-                nnk_twi_ack();
-        // else about to receive the last data
-        else
-                nnk_twi_nack();
-
-        return;
+// 0x90 : in gen call, data received, ack sent
+static inline void nnk_twi_sr_gcall_data_ack(void)
+{
+        nnk_twi_sl_rx_store();
+        nnk_twi_sl_rx_ack();
+}
 
-_TW_SR_GCALL_DATA_NACK:		// 0x98 : in gen call, data received, nack sent
+// 0x98 : in gen call, data received, nack sent
+static inline void nnk_twi_sr_gcall_data_nack(void)
+{
         // last byte received
-
-        // store it
-        *(twi.sl_buf + twi.nb_data) = nnk_twi_read();
-        twi.nb_data++;
+        nnk_twi_sl_rx_store();
 
         // signal end of rx
         nnk_twi_call_back_call(NNK_TWI_GENCALL_END);
+}
 
-        return;
-
-_TW_SR_STOP:			// 0xa0 : stop or restart received
-        // the previous transfer as slace receiver (general call or not)
+// 0xa0 : stop or restart received
+static inline void nnk_twi_sr_stop(void)
+{
+        // the previous transfer as slave receiver (general call or not)
         // is completely finished
+
+        // register bank mode, the changes are notified from nnk_twi_regs_poll()
+        if ( (twi.regs[0] != NULL) && (twi.state == NNK_TWI_SL_RX_BEGIN) ) {
+                nnk_twi_regs_end();
+                return;
+        }
+
         if (twi.state == NNK_TWI_SL_RX_BEGIN)
                 nnk_twi_call_back_call(NNK_TWI_SL_RX_END);
         else
@@ -480,35 +713,227 @@ _TW_SR_STOP:			// 0xa0 : stop or restart received
         if (twi.ms_buf_len != 0)
                 // generate a restart
                 TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+}
+
+// 0xa8 : own slave addr + R
+// 0xb0 : arb lost as master, own slave addr + R
+static inline void nnk_twi_st_sla_ack(void)
+{
+        // reset nb_data to zero
+        twi.nb_data = 0;
+
+        // register bank mode, send the registers from the pointer
+        if ( twi.regs[0] != NULL ) {
+                twi.state = NNK_TWI_SL_TX_BEGIN;
+                if ( twi.regs_ptr < twi.regs_len ) {
+                        twi.sl_buf = twi.regs[twi.regs_front] + twi.regs_ptr;
+                        twi.sl_buf_len = twi.regs_len - twi.regs_ptr;
+                }
+                else {
+                        twi.sl_buf_len = 0;
+                }
+        }
+        // need support from application
+        // a buffer to transmit shall be provided
+        else
+                nnk_twi_call_back_call(NNK_TWI_SL_TX_BEGIN);
+
+        nnk_twi_sl_tx_next();
+}
 
-        return;
+static inline void nnk_twi_st_sla_arb(void)
+{
+        nnk_twi_sl_arb_lost();
+        nnk_twi_st_sla_ack();
+}
+
+// 0xc0 : byte transmit, nack received
+// 0xc8 : last data transmit, ack received
+static inline void nnk_twi_st_end(void)
+{
+        // register bank mode, the pointer auto-increments
+        if ( twi.regs[0] != NULL ) {
+                twi.regs_ptr += twi.nb_data;
+                nnk_twi_regs_end();
+                return;
+        }
+
+        // signal it to the application
+        nnk_twi_call_back_call(NNK_TWI_SL_TX_END);
+
+        // if we have data to send or receive as master
+        if (twi.ms_buf_len != 0) {
+                // generate a restart
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+        }
+        else {
+                // give up bus control, wait for next start
+                TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+                twi.state = NNK_TWI_IDLE;
+        }
+}
 
-        // -----------------------------------------------------------------------
-        // Error cases
-_TW_NO_INFO:			// 0xf8 : no relevant information
+// 0xf8 : no relevant information
+static inline void nnk_twi_no_info(void)
+{
         // back to idle state: re-enable interface
         TWCR = _BV(TWEA) | _BV(TWINT) | _BV(TWEN)  | _BV(TWIE);
 
         // signal idle mode
         nnk_twi_call_back_call(NNK_TWI_IDLE);
+}
 
-        return;
-
-_TW_BUS_ERROR:			// 0x00 : internal protocol violation
-        // hardware error (may I mess the registers!?!? :-) )
-
-        // recover releasing the bus
-        //TWCR = _BV(TWEA) | _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+// unknown status
+static inline void nnk_twi_other(void)
+{
         nnk_twi_call_back_call(NNK_TWI_ERROR);
+}
 
-        return;
-
-other:				// unknown status
-        // so, what happens?????
+// TWI_isr
+//
+// the switch is turned into a jump table by the compiler
+// and the handlers are inlined in it,
+// so the ISR calls no function through a pointer
+ISR(TWI_vect)
+{
+        u8 status;
+#if NNK_TWI_PROFILE
+        u16 (*clock)(void) = twi.prof_clock;
+        u16 start = 0;
+        u16 duration;
+        u8 idx;
+        volatile struct nnk_twi_prof* prof;
+#endif
 
-        nnk_twi_call_back_call(NNK_TWI_ERROR);
+        // check status
+        status = TW_STATUS;
+
+#if NNK_TWI_PROFILE
+        if ( clock != NULL )
+                start = clock();
+#endif
+
+        switch ( status ) {
+        case TW_BUS_ERROR:
+                nnk_twi_bus_error();
+                break;
+
+        case TW_START:
+        case TW_REP_START:
+                nnk_twi_started();
+                break;
+
+        case TW_MT_SLA_ACK:
+        case TW_MT_DATA_ACK:
+                nnk_twi_ms_tx_next();
+                break;
+
+        case TW_MT_SLA_NACK:
+        case TW_MR_SLA_NACK:
+                nnk_twi_no_sl();
+                break;
+
+        case TW_MT_DATA_NACK:
+                nnk_twi_mt_data_nack();
+                break;
+
+        case TW_MT_ARB_LOST:
+                nnk_twi_arb_lost();
+                break;
+
+        case TW_MR_SLA_ACK:
+                nnk_twi_ms_rx_ack();
+                break;
+
+        case TW_MR_DATA_ACK:
+                nnk_twi_mr_data_ack();
+                break;
+
+        case TW_MR_DATA_NACK:
+                nnk_twi_mr_data_nack();
+                break;
+
+        case TW_SR_SLA_ACK:
+                nnk_twi_sr_sla_ack();
+                break;
+
+        case TW_SR_ARB_LOST_SLA_ACK:
+                nnk_twi_sr_sla_arb();
+                break;
+
+        case TW_SR_GCALL_ACK:
+                nnk_twi_sr_gcall_ack();
+                break;
+
+        case TW_SR_ARB_LOST_GCALL_ACK:
+                nnk_twi_sr_gcall_arb();
+                break;
+
+        case TW_SR_DATA_ACK:
+                nnk_twi_sr_data_ack();
+                break;
+
+        case TW_SR_DATA_NACK:
+                nnk_twi_sr_data_nack();
+                break;
+
+        case TW_SR_GCALL_DATA_ACK:
+                nnk_twi_sr_gcall_data_ack();
+                break;
+
+        case TW_SR_GCALL_DATA_NACK:
+                nnk_twi_sr_gcall_data_nack();
+                break;
+
+        case TW_SR_STOP:
+                nnk_twi_sr_stop();
+                break;
+
+        case TW_ST_SLA_ACK:
+                nnk_twi_st_sla_ack();
+                break;
+
+        case TW_ST_ARB_LOST_SLA_ACK:
+                nnk_twi_st_sla_arb();
+                break;
+
+        case TW_ST_DATA_ACK:
+                nnk_twi_sl_tx_next();
+                break;
+
+        case TW_ST_DATA_NACK:
+        case TW_ST_LAST_DATA:
+                nnk_twi_st_end();
+                break;
+
+        case TW_NO_INFO:
+                nnk_twi_no_info();
+                break;
+
+        default:
+                nnk_twi_other();
+                break;
+        }
 
-        return;
+#if NNK_TWI_PROFILE
+        if ( clock != NULL ) {
+                duration = clock() - start;
+
+                // the TWI status is only the 5 MSB bits of the register
+                if ( status <= TW_ST_LAST_DATA )
+                        idx = status >> 3;
+                else if ( status == TW_NO_INFO )
+                        idx = NNK_TWI_IDX_NO_INFO;
+                else
+                        idx = NNK_TWI_IDX_OTHER;
+
+                prof = &twi.prof[idx];
+                prof->cnt++;
+                prof->sum += duration;
+                if ( duration > prof->max )
+                        prof->max = duration;
+        }
+#endif
 }
 
 
@@ -521,17 +946,13 @@ void nnk_twi_init(void(*call_back)(enum nnk_twi_state state, u8 nb_data, void* m
         // switch off TWI interface
         TWCR = 0x00;
 
-        // disable internal pull-ups of SDA and SCL (PC4 and PC5)
+        // disable internal pull-ups of SDA and SCL
         MCUCR |= _BV(PUD);
-        DDRC &= ~( _BV(DDC4) | _BV(DDC5) );
-        PORTC &= ~( _BV(PORTC4) | _BV(PORTC5) );
+        DDRC &= ~( _BV(NNK_TWI_SDA) | _BV(NNK_TWI_SCL) );
+        PORTC &= ~( _BV(NNK_TWI_SDA) | _BV(NNK_TWI_SCL) );
 
-        // bit rate 100k
-        // prescaler = 1
-        TWSR = NNK_TWI_PRESCALER_1;
-
-        // baud rate = 32
-        TWBR = 32;
+        // default bit rate
+        nnk_twi_bitrate_set(NNK_TWI_BITRATE(NNK_TWI_RATE));
 
         // reset engine state to IDLE
         twi.state = NNK_TWI_IDLE;
@@ -545,6 +966,20 @@ void nnk_twi_init(void(*call_back)(enum nnk_twi_state state, u8 nb_data, void* m
         // set the misc pointer
         twi.misc = misc;
 
+        // no register bank
+        twi.regs[0] = NULL;
+
+        // no retry
+        twi.retry = 0;
+        nnk_twi_owner_set(0);
+        nnk_twi_stats_reset();
+        nnk_twi_prof_reset();
+
+        // no queued transaction
+        twi.cur = NULL;
+        twi.head = NULL;
+        twi.tail = NULL;
+
         // enable automatic ACK bit and TWI interface in interrupt mode
         // resetting any previous interrupt
         TWCR = _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
@@ -554,6 +989,56 @@ void nnk_twi_init(void(*call_back)(enum nnk_twi_state state, u8 nb_data, void* m
 }
 
 
+// compute the bit rate settings of a bus speed
+// return 0xffff if the speed can't be reached
+static u16 nnk_twi_bitrate(u32 rate)
+{
+        u32 div;
+        u32 twbr;
+        u8 ps;
+
+        if ( rate == 0 )
+                return 0xffff;
+
+        // CPU cycles per SCL period, rounded up
+        div = (F_CPU + rate - 1) / rate;
+        if ( div < 16 )
+                return 0xffff;
+
+        // find the lowest prescaler
+        for ( ps = 0; ps <= NNK_TWI_PRESCALER_64; ps++ ) {
+                twbr = (div - 16 + (2UL << (2 * ps)) - 1) / (2UL << (2 * ps));
+                if ( twbr <= 255 )
+                        return twbr | (ps << 8);
+        }
+
+        return 0xffff;
+}
+
+
+void nnk_twi_bitrate_set(u16 bitrate)
+{
+        twi.bitrate = bitrate;
+
+        // a queued transaction may be running at its own speed
+        if ( twi.cur == NULL )
+                nnk_twi_rate_apply(bitrate);
+}
+
+
+u8 nnk_twi_rate_set(u32 rate)
+{
+        u16 bitrate = nnk_twi_bitrate(rate);
+
+        if ( bitrate == 0xffff )
+                return KO;
+
+        nnk_twi_bitrate_set(bitrate);
+
+        return OK;
+}
+
+
 void nnk_twi_sl_addr_set(u8 sl_addr)
 {
         TWAR &= _BV(TWGCE);		// reset the TWAR except the general call recognition bit
@@ -589,6 +1074,7 @@ void nnk_twi_stop(void)
         if (TW_STATUS != TW_NO_INFO) {
                 // try to generate a STOP
                 TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWSTO) | _BV(TWIE);
+                nnk_twi_owner_set(0);
 
                 // in master mode, when the STOP is executed on the bus,
                 // the TWSTO bit is cleared automatically.
@@ -596,6 +1082,10 @@ void nnk_twi_stop(void)
 
         // reset engine state to IDLE
         twi.state = NNK_TWI_IDLE;
+
+        // the bus is free for a queued transaction
+        if ( twi.cur == NULL )
+                nnk_twi_xfer_next();
 }
 
 
@@ -612,6 +1102,9 @@ u8 nnk_twi_ms_tx(u8 adr, u8 len, u8* data)
         // reset TWI state
         twi.state = NNK_TWI_MS_TX_BEGIN;
 
+        // bus speed of the single comms
+        nnk_twi_rate_apply(twi.bitrate);
+
         // set ms_buf
         twi.ms_buf = data;
         twi.ms_buf_len = len;
@@ -619,6 +1112,11 @@ u8 nnk_twi_ms_tx(u8 adr, u8 len, u8* data)
         // set addr with write bit
         twi.addr = (adr << 1) | TW_WRITE;
 
+        // arm the watchdog
+        twi.last = nnk_time_get();
+        twi.retries = 0;
+        twi.retry = 0;
+
         // begin transmission
         nnk_twi_start();
 
@@ -639,6 +1137,9 @@ u8 nnk_twi_ms_rx(u8 adr, u8 len, u8* data)
         // reset TWI state
         twi.state = NNK_TWI_MS_RX_BEGIN;
 
+        // bus speed of the single comms
+        nnk_twi_rate_apply(twi.bitrate);
+
         // set rx_buf
         twi.ms_buf = data;
         twi.ms_buf_len = len;
@@ -646,6 +1147,11 @@ u8 nnk_twi_ms_rx(u8 adr, u8 len, u8* data)
         // set addr with read bit
         twi.addr = (adr << 1) | TW_READ;
 
+        // arm the watchdog
+        twi.last = nnk_time_get();
+        twi.retries = 0;
+        twi.retry = 0;
+
         // begin transmission
         nnk_twi_start();
 
@@ -686,3 +1192,323 @@ u8 nnk_twi_sl_rx(u8 len, u8* data)
 
         return OK;
 }
+
+
+u8 nnk_twi_submit(struct nnk_twi_xfer* xfer)
+{
+        u8 i;
+        u8 sreg;
+
+        // check if not already queued
+        if ( xfer->state == NNK_TWI_QUEUED )
+                return KO;
+
+        // check the segments
+        if ( xfer->nb_segs == 0 )
+                return KO;
+
+        for ( i = 0; i < xfer->nb_segs; i++ ) {
+                if ( (xfer->segs[i].dir == NNK_TWI_READ) && (xfer->segs[i].len == 0) )
+                        return KO;
+        }
+
+        // compute its bus speed now rather than in the ISR
+        if ( xfer->rate != 0 ) {
+                xfer->bitrate = nnk_twi_bitrate(xfer->rate);
+                if ( xfer->bitrate == 0xffff )
+                        return KO;
+        }
+
+        xfer->state = NNK_TWI_QUEUED;
+        xfer->nb_data = 0;
+        xfer->next = NULL;
+
+        sreg = SREG;
+        cli();
+
+        // enqueue it
+        if ( twi.tail != NULL )
+                twi.tail->next = xfer;
+        else
+                twi.head = xfer;
+        twi.tail = xfer;
+
+        // start it now if the bus is free
+        if ( (twi.cur == NULL) && ( (twi.state == NNK_TWI_IDLE) || (twi.state == NNK_TWI_ERROR) ) )
+                nnk_twi_xfer_next();
+
+        SREG = sreg;
+
+        return OK;
+}
+
+
+u8 nnk_twi_is_fini(const struct nnk_twi_xfer* xfer)
+{
+        return (xfer->state == NNK_TWI_QUEUED) ? KO : OK;
+}
+
+
+u8 nnk_twi_is_ok(const struct nnk_twi_xfer* xfer)
+{
+        return ( (xfer->state == NNK_TWI_MS_TX_END) || (xfer->state == NNK_TWI_MS_RX_END) ) ? OK : KO;
+}
+
+
+void nnk_twi_regs_init(u8 sl_addr, u8* regs, u8* back, u8 len, void (*changed)(const u8* regs, u8 first, u8 len, void* misc), void* misc)
+{
+        u8 sreg = SREG;
+        cli();
+
+        twi.regs[0] = regs;
+        twi.regs[1] = back;
+        twi.regs_front = 0;
+        twi.regs_len = len;
+        twi.regs_ptr = 0;
+        twi.regs_swap = 0;
+        twi.regs_chg = 0;
+        twi.regs_changed = changed;
+        twi.regs_misc = misc;
+
+        SREG = sreg;
+
+        if ( regs != NULL )
+                nnk_twi_sl_addr_set(sl_addr);
+}
+
+
+u8* nnk_twi_regs_edit(void)
+{
+        u8* front;
+        u8* back;
+        u8 i;
+
+        // not double buffered or previous edit not yet published
+        if ( (twi.regs[1] == NULL) || twi.regs_swap )
+                return NULL;
+
+        // start from the current registers
+        front = twi.regs[twi.regs_front];
+        back = twi.regs[twi.regs_front ^ 1];
+        for ( i = 0; i < twi.regs_len; i++ )
+                back[i] = front[i];
+
+        return back;
+}
+
+
+void nnk_twi_regs_commit(void)
+{
+        u8 sreg = SREG;
+        cli();
+
+        // swap now unless the master is using the registers
+        if ( (twi.state == NNK_TWI_SL_RX_BEGIN) || (twi.state == NNK_TWI_SL_TX_BEGIN) )
+                twi.regs_swap = 1;
+        else
+                twi.regs_front ^= 1;
+
+        SREG = sreg;
+}
+
+
+void nnk_twi_regs_poll(void)
+{
+        u8 first;
+        u8 last;
+        u8 sreg = SREG;
+        cli();
+
+        if ( !twi.regs_chg ) {
+                SREG = sreg;
+                return;
+        }
+
+        first = twi.regs_chg_first;
+        last = twi.regs_chg_last;
+        twi.regs_chg = 0;
+
+        SREG = sreg;
+
+        if ( twi.regs_changed != NULL )
+                twi.regs_changed(twi.regs[twi.regs_front], first, last - first + 1, twi.regs_misc);
+}
+
+
+void nnk_twi_poll(void)
+{
+        u32 now = nnk_time_get();
+        u8 sreg = SREG;
+        cli();
+
+        // a queued transaction waiting for the end of the STOP to change the bus speed
+        if ( (twi.cur == NULL) && (twi.head != NULL) && !(TWCR & _BV(TWSTO))
+                        && ( (twi.state == NNK_TWI_IDLE) || (twi.state == NNK_TWI_ERROR) ) )
+                nnk_twi_xfer_next();
+
+        // no master comm running
+        if ( (twi.cur == NULL) && (twi.state != NNK_TWI_MS_TX_BEGIN) && (twi.state != NNK_TWI_MS_RX_BEGIN) ) {
+                SREG = sreg;
+                return;
+        }
+
+        // end of the backoff, retry
+        if ( twi.retry ) {
+                if ( now - twi.retry_time >= ((u32)NNK_TWI_BACKOFF << (twi.retries - 1)) ) {
+                        twi.retry = 0;
+                        twi.last = now;
+                        nnk_twi_start();
+                }
+        }
+        // comm stuck, give it up
+        else if ( now - twi.last >= NNK_TWI_TIMEOUT ) {
+                twi.stats.timeouts++;
+
+                // a slave holds SDA low, free the bus
+                if ( nnk_twi_sda_stuck() ) {
+                        nnk_twi_recover();
+                }
+                // release our comm
+                else if ( twi.owner ) {
+                        TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWSTO) | _BV(TWIE);
+                }
+                // still waiting for another master to free the bus,
+                // only cancel the START without disturbing its comm
+                else {
+                        TWCR = _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+                }
+                nnk_twi_owner_set(0);
+
+                twi.ms_buf_len = 0;
+                nnk_twi_call_back_call(NNK_TWI_ERROR);
+        }
+
+        SREG = sreg;
+}
+
+
+void nnk_twi_recover(void)
+{
+        u8 i;
+        u8 sreg = SREG;
+        cli();
+
+        // take the pins over from the TWI block
+        // they are driven low by the direction, else released to the pull-ups
+        TWCR = 0;
+        PORTC &= ~( _BV(NNK_TWI_SDA) | _BV(NNK_TWI_SCL) );
+        DDRC &= ~( _BV(NNK_TWI_SDA) | _BV(NNK_TWI_SCL) );
+
+        // clock out nine bits so a slave holding SDA low ends its byte
+        for ( i = 0; i < 9; i++ ) {
+                DDRC |= _BV(NNK_TWI_SCL);
+                _delay_us(NNK_TWI_RECOVER_DELAY);
+                DDRC &= ~_BV(NNK_TWI_SCL);
+                _delay_us(NNK_TWI_RECOVER_DELAY);
+        }
+
+        // generate a STOP: SDA rising while SCL is high
+        DDRC |= _BV(NNK_TWI_SCL);
+        DDRC |= _BV(NNK_TWI_SDA);
+        _delay_us(NNK_TWI_RECOVER_DELAY);
+        DDRC &= ~_BV(NNK_TWI_SCL);
+        _delay_us(NNK_TWI_RECOVER_DELAY);
+        DDRC &= ~_BV(NNK_TWI_SDA);
+        _delay_us(NNK_TWI_RECOVER_DELAY);
+
+        // give the pins back to the TWI block
+        TWCR = _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+
+        nnk_twi_owner_set(0);
+        twi.stats.recoveries++;
+
+        SREG = sreg;
+}
+
+
+void nnk_twi_stats_get(struct nnk_twi_stats* stats)
+{
+        u8 sreg = SREG;
+        cli();
+
+        *stats = twi.stats;
+
+        SREG = sreg;
+}
+
+
+void nnk_twi_stats_reset(void)
+{
+        u8 sreg = SREG;
+        cli();
+
+        twi.stats.timeouts = 0;
+        twi.stats.bus_errors = 0;
+        twi.stats.arb_lost = 0;
+        twi.stats.no_slave = 0;
+        twi.stats.recoveries = 0;
+        twi.stats.failures = 0;
+
+        SREG = sreg;
+}
+
+
+void nnk_twi_prof_clock_set(u16 (*clock)(void))
+{
+#if NNK_TWI_PROFILE
+        twi.prof_clock = clock;
+#else
+        (void)clock;
+#endif
+}
+
+
+u8 nnk_twi_prof_get(u8 status, struct nnk_twi_prof* prof)
+{
+        u8 idx;
+        u8 sreg;
+
+        if ( (status & 0x07) != 0 )
+                return KO;
+
+        if ( status <= TW_ST_LAST_DATA )
+                idx = status >> 3;
+        else if ( status == TW_NO_INFO )
+                idx = NNK_TWI_IDX_NO_INFO;
+        else
+                return KO;
+
+        sreg = SREG;
+        cli();
+
+#if NNK_TWI_PROFILE
+        *prof = twi.prof[idx];
+#else
+        (void)idx;
+        prof->cnt = 0;
+        prof->max = 0;
+        prof->sum = 0;
+#endif
+
+        SREG = sreg;
+
+        return OK;
+}
+
+
+void nnk_twi_prof_reset(void)
+{
+#if NNK_TWI_PROFILE
+        u8 i;
+        u8 sreg = SREG;
+        cli();
+
+        for ( i = 0; i < NNK_TWI_NB_STATUS; i++ ) {
+                twi.prof[i].cnt = 0;
+                twi.prof[i].max = 0;
+                twi.prof[i].sum = 0;
+        }
+
+        SREG = sreg;
+#endif
+}
@@ -23,11 +23,83 @@
 # define __NNK_TWI_H__
 
 # include "type_def.h"
+# include "utils/time.h"
 
 # define NNK_TWI_BROADCAST_ADDR	0x00
 # define NNK_TWI_FIRST_ADDR		0x01
 # define NNK_TWI_LAST_ADDR		0x7f
 
+// bus speed
+//
+// SCL frequency = F_CPU / (16 + 2 * TWBR * prescaler)
+// the bit rate settings hold TWBR (bits 0-7) and the prescaler bits of TWSR (bits 8-9).
+// NNK_TWI_BITRATE() computes them at compile time from F_CPU and the frequency,
+// rounding to the nearest frequency not above the requested one
+// (or to the fastest one when the requested one is out of reach).
+// the frequency shall be a constant expression.
+//
+# ifndef F_CPU
+#  define F_CPU		8000000UL	// historical clock of the library
+# endif
+
+# define NNK_TWI_100K		100000UL	// standard mode
+# define NNK_TWI_400K		400000UL	// fast mode
+
+// bus speed set by nnk_twi_init()
+# ifndef NNK_TWI_RATE
+#  define NNK_TWI_RATE		NNK_TWI_100K
+# endif
+
+// watchdog and retries
+//
+// a master comm without any start, segment or state change during NNK_TWI_TIMEOUT
+// is given up with NNK_TWI_ERROR, so the timeout shall be longer than the longest segment.
+// when the bus should be free and SDA stays low during a byte time,
+// a slave is assumed to hold it and the bus is recovered:
+// on a bus error, on a comm given up after its retries and on timeout.
+// else a comm still waiting for another master to free the bus is just cancelled.
+// a master comm losing its arbitration is retried up to NNK_TWI_RETRIES times,
+// the n-th retry waiting NNK_TWI_BACKOFF << (n - 1) once the bus is free
+// (NNK_TWI_BACKOFF set to 0 retries as soon as the bus is free).
+// the times are in nnk_time units, the timeout shall be longer than the longest backoff.
+// both are handled by nnk_twi_poll().
+//
+# ifndef NNK_TWI_TIMEOUT
+#  define NNK_TWI_TIMEOUT	(25 * TIME_1_MSEC)
+# endif
+
+# ifndef NNK_TWI_RETRIES
+#  define NNK_TWI_RETRIES	4
+# endif
+
+# ifndef NNK_TWI_BACKOFF
+#  define NNK_TWI_BACKOFF	TIME_1_MSEC
+# endif
+
+// profiling
+//
+// the time spent in the ISR for each TWI status is measured
+// with a clock function given by the application, for instance reading TCNT1,
+// when NNK_TWI_PROFILE is defined to 1 (it costs 8 bytes of RAM per status).
+//
+# ifndef NNK_TWI_PROFILE
+#  define NNK_TWI_PROFILE	0
+# endif
+
+// CPU cycles per SCL period, rounded up
+# define NNK_TWI_DIV(rate)	((F_CPU + (u32)(rate) - 1) / (u32)(rate))
+
+// TWBR for a prescaler, rounded up
+# define NNK_TWI_TWBR(rate, ps)	((NNK_TWI_DIV(rate) - 16 + 2 * (ps) - 1) / (2 * (ps)))
+
+# define NNK_TWI_BITRATE(rate)						\
+	( (NNK_TWI_DIV(rate) < 16) ? 0 :					\
+	  (NNK_TWI_TWBR(rate, 1) <= 255) ? NNK_TWI_TWBR(rate, 1) :		\
+	  (NNK_TWI_TWBR(rate, 4) <= 255) ? (NNK_TWI_TWBR(rate, 4) | 0x100) :	\
+	  (NNK_TWI_TWBR(rate, 16) <= 255) ? (NNK_TWI_TWBR(rate, 16) | 0x200) :	\
+	  (NNK_TWI_TWBR(rate, 64) <= 255) ? (NNK_TWI_TWBR(rate, 64) | 0x300) :	\
+	  0x3ff )
+
 enum nnk_twi_state {
 	NNK_TWI_IDLE,		// just idle
 	NNK_TWI_NO_SL,		// no slave at the given address
@@ -41,9 +113,68 @@ enum nnk_twi_state {
 	NNK_TWI_SL_TX_END,		// slave mode, transmission to master finished
 	NNK_TWI_GENCALL_BEGIN,	// general call, reception from master beginning
 	NNK_TWI_GENCALL_END,	// general call, reception from master finished
-	NNK_TWI_ERROR		// error in the protocol or in the state machine
+	NNK_TWI_ERROR,		// error in the protocol or in the state machine
+	NNK_TWI_QUEUED		// queued transaction waiting for or using the bus
 };	// automata states
 
+// error counters
+struct nnk_twi_stats {
+	u16 timeouts;		// master comms stuck on the bus
+	u16 bus_errors;		// illegal start or stop conditions
+	u16 arb_lost;		// arbitrations lost
+	u16 no_slave;		// slave addresses not acknowledged
+	u16 recoveries;		// bus recoveries
+	u16 failures;		// master comms given up after the retries
+};
+
+// time spent in the ISR for a TWI status, in ticks of the profiling clock
+// the call_back functions called from the ISR are included
+struct nnk_twi_prof {
+	u16 cnt;		// number of interrupts
+	u16 max;		// longest one
+	u32 sum;		// total
+};
+
+// direction of a segment
+enum nnk_twi_dir {
+	NNK_TWI_WRITE,		// master to slave
+	NNK_TWI_READ		// slave to master
+};
+
+// a segment of a queued transaction
+struct nnk_twi_seg {
+	enum nnk_twi_dir dir;
+	u8 len;			// number of data to send or to read (not 0 to read)
+	u8* buf;		// data buffer belonging to the caller
+};
+
+// a queued master transaction
+//
+// its segments are exchanged with the same slave,
+// separated by repeated starts and ended by a single stop.
+// the descriptor, the segments and their buffers belong to the caller
+// and shall remain allocated till the end of the transaction.
+struct nnk_twi_xfer {
+	u8 addr;		// slave I2C address
+	u32 rate;		// bus speed in Hz, 0 to keep the current one
+
+	const struct nnk_twi_seg* segs;
+	u8 nb_segs;
+
+	// optional call-back called from ISR at the end of the transaction
+	// with NNK_TWI_MS_TX_END or NNK_TWI_MS_RX_END (state of the last segment),
+	// NNK_TWI_NO_SL or NNK_TWI_ERROR.
+	// a new transaction can be submitted from it.
+	void (*call_back)(enum nnk_twi_state state, u8 nb_data, void* misc);
+	void* misc;
+
+	// private
+	volatile enum nnk_twi_state state;
+	u8 nb_data;		// number of data exchanged
+	u16 bitrate;		// bit rate settings of the rate
+	struct nnk_twi_xfer* next;
+};
+
 // init the TWI component
 //
 // by default, address recognition is disabled
@@ -75,6 +206,55 @@ enum nnk_twi_state {
 //
 extern void nnk_twi_init(void(*call_back)(enum nnk_twi_state state, u8 nb_data, void* misc), void* misc);
 
+// set the bus speed of the master comms
+// bitrate : bit rate settings, computed by NNK_TWI_BITRATE()
+// shall be called when the bus is idle
+//
+extern void nnk_twi_bitrate_set(u16 bitrate);
+
+// set the bus speed of the master comms in Hz
+// the bit rate settings are computed at run time,
+// so it is slower than nnk_twi_bitrate_set()
+// shall be called when the bus is idle
+//
+// if the speed can't be reached, it returns KO else OK
+//
+extern u8 nnk_twi_rate_set(u32 rate);
+
+// watchdog and retries handling
+// shall be called periodically from the main loop, with the time running
+//
+extern void nnk_twi_poll(void);
+
+// free a bus held by a slave
+// clock out nine SCL pulses then generate a STOP
+// it is done automatically on a bus error, a comm given up or a timeout when SDA is stuck low
+//
+extern void nnk_twi_recover(void);
+
+// get a copy of the error counters
+//
+extern void nnk_twi_stats_get(struct nnk_twi_stats* stats);
+
+// reset the error counters
+//
+extern void nnk_twi_stats_reset(void);
+
+// set the clock used for profiling the ISR (NULL to stop)
+//
+extern void nnk_twi_prof_clock_set(u16 (*clock)(void));
+
+// get the profile of a TWI status (0x00 to 0xc8 or 0xf8)
+// all zeroed if NNK_TWI_PROFILE is 0
+//
+// if the status is unknown, it returns KO else OK
+//
+extern u8 nnk_twi_prof_get(u8 status, struct nnk_twi_prof* prof);
+
+// reset the profiles
+//
+extern void nnk_twi_prof_reset(void);
+
 // set the I2C address
 // setting the address to zero means setting the TWI as master
 // as it will respond only to general call if enabled.
@@ -110,6 +290,35 @@ extern void nnk_twi_stop(void);
 extern u8 nnk_twi_ms_tx(u8 adr, u8 len, u8* data);
 extern u8 nnk_twi_ms_rx(u8 adr, u8 len, u8* data);
 
+// queued master comm
+//
+// the transactions are executed back-to-back by the ISR,
+// without any help from the init call_back function.
+// each transaction can use its own bus speed,
+// so slow and fast devices can share the bus.
+// the speed is switched when the next comm starts, once the STOP is done,
+// a transaction then waiting for the STOP being started by nnk_twi_poll().
+// for instance, a sensor register is read with a transaction of 2 segments:
+// a write of the register address then a read of its value.
+//
+// a queued transaction starts when the bus is free:
+// after the current queued one or after nnk_twi_stop() for a single comm.
+//
+// if the transaction is already queued or malformed, it returns KO else OK
+//
+extern u8 nnk_twi_submit(struct nnk_twi_xfer* xfer);
+
+// check if the transaction is done
+extern u8 nnk_twi_is_fini(const struct nnk_twi_xfer* xfer);
+
+// check if the transaction is OK
+extern u8 nnk_twi_is_ok(const struct nnk_twi_xfer* xfer);
+
+# ifdef __PT_H__
+#  define PT_TWI_WAIT(pt, xfer)				\
+	PT_WAIT_UNTIL((pt), nnk_twi_is_fini(xfer))
+# endif	// __PT_H__
+
 // slave comm
 //
 // when being addressed as slave, those functions are to be
@@ -123,6 +332,39 @@ extern u8 nnk_twi_ms_rx(u8 adr, u8 len, u8* data);
 extern u8 nnk_twi_sl_tx(u8 len, u8* data);
 extern u8 nnk_twi_sl_rx(u8 len, u8* data);
 
+// register bank slave
+//
+// the TWI behaves like a standard I2C sensor: the master writes a register pointer,
+// then writes or reads the registers from it, the pointer auto-incrementing.
+// the slave comms are handled by the ISR without calling the init call_back function,
+// except for general calls.
+// the registers beyond the bank are read as dummy values and their writes are nacked.
+//
+// the changes done by the master are notified from the main loop
+// by nnk_twi_regs_poll() calling changed() with the current bank
+// and the range of the changed registers.
+//
+// with a single bank (back is NULL), the application updates the registers directly.
+// with two banks, nnk_twi_regs_edit() gives the back bank filled with the current registers,
+// and nnk_twi_regs_commit() publishes it, at the end of the slave transaction if any,
+// so the master never reads half-updated registers.
+// the registers written by the master between the edit and the commit are lost.
+//
+// regs : register bank belonging to the caller, NULL to go back to the call_back handling
+// back : optional second bank of the same length
+// len : number of registers
+//
+extern void nnk_twi_regs_init(u8 sl_addr, u8* regs, u8* back, u8 len, void (*changed)(const u8* regs, u8 first, u8 len, void* misc), void* misc);
+
+// get the back bank to update, NULL if not double-buffered or if the previous edit is not yet published
+extern u8* nnk_twi_regs_edit(void);
+
+// publish the back bank
+extern void nnk_twi_regs_commit(void);
+
+// notify the changes done by the master, to be called from the main loop
+extern void nnk_twi_regs_poll(void);
+
 // general call
 //
 // when addressed in general call,
@@ -195,5 +437,9 @@ extern u8 nnk_twi_sl_rx(u8 len, u8* data);
 // 	nothing to do except trying to stop the current transfert
 // 	-> stop communication:	nnk_twi_stop()
 //
+// - NNK_TWI_QUEUED:
+// 	will never happened, the queued transactions are signaled by their own call_back
+// 	-> nothing to do then!!!
+//
 
 #endif
@@ -0,0 +1,144 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// CONFIG
+//
+// see description in config.h
+//
+
+#include "utils/config.h"
+
+#include <string.h>		// memcpy(), memcmp()
+
+
+// ---------------------------------------
+// public fonctions
+//
+
+u8 nnk_cfg_init(struct nnk_cfg* cfg, u16 base, u16 size, u8 version, void* values, u8 len, const void* defaults, u8* buf)
+{
+	u8 ret;
+
+	cfg->values = values;
+	cfg->len = len;
+	cfg->version = version;
+	cfg->buf = buf;
+	cfg->dirty = 0;
+
+	// the record holds the version then the configuration
+	ret = nnk_eep_log_init(&cfg->log, base, size, len + 1, buf);
+	if ( ret == OK ) {
+		if ( nnk_eep_log_read(&cfg->log, buf) == KO ) {
+			// the log can only be read when the EEPROM is idle,
+			// it must not be written back over the stored configuration
+			cfg->log.nb = 0;
+			ret = NNK_CFG_BUSY;
+		}
+		else if ( buf[0] == version ) {
+			memcpy(values, buf + 1, len);
+
+			return OK;
+		}
+		else
+			ret = KO;
+	}
+
+	// no valid configuration, use the defaults
+	memcpy(values, defaults, len);
+
+	return ret;
+}
+
+
+u8 nnk_cfg_set(struct nnk_cfg* cfg, u8 key, const void* data, u8 len)
+{
+	// out of the configuration
+	if ( (key >= cfg->len) || (len > cfg->len - key) )
+		return KO;
+
+	// unchanged
+	if ( memcmp(cfg->values + key, data, len) == 0 )
+		return OK;
+
+	memcpy(cfg->values + key, data, len);
+
+	cfg->dirty = 1;
+	cfg->dirty_time = nnk_time_get();
+
+	return OK;
+}
+
+
+u8 nnk_cfg_set_u8(struct nnk_cfg* cfg, u8 key, u8 val)
+{
+	return nnk_cfg_set(cfg, key, &val, sizeof(val));
+}
+
+
+u8 nnk_cfg_set_u16(struct nnk_cfg* cfg, u8 key, u16 val)
+{
+	return nnk_cfg_set(cfg, key, &val, sizeof(val));
+}
+
+
+u8 nnk_cfg_set_u32(struct nnk_cfg* cfg, u8 key, u32 val)
+{
+	return nnk_cfg_set(cfg, key, &val, sizeof(val));
+}
+
+
+void nnk_cfg_poll(struct nnk_cfg* cfg)
+{
+	// write back once the writes are over
+	if ( cfg->dirty && (nnk_time_get() - cfg->dirty_time >= NNK_CFG_DELAY) )
+		nnk_cfg_flush(cfg);
+}
+
+
+u8 nnk_cfg_flush(struct nnk_cfg* cfg)
+{
+	u8* buf = cfg->buf;
+
+	if ( !cfg->dirty )
+		return OK;
+
+	// previous write back not finished
+	if ( !nnk_eep_log_is_fini(&cfg->log) )
+		return KO;
+
+	// the configuration is copied in the record,
+	// so it can be changed again during the write
+	buf[0] = cfg->version;
+	memcpy(buf + 1, cfg->values, cfg->len);
+
+	if ( nnk_eep_log_append(&cfg->log, buf, NULL, NULL) == KO )
+		return KO;
+
+	cfg->dirty = 0;
+
+	return OK;
+}
+
+
+u8 nnk_cfg_is_fini(const struct nnk_cfg* cfg)
+{
+	return ( !cfg->dirty && nnk_eep_log_is_fini(&cfg->log) ) ? OK : KO;
+}
@@ -0,0 +1,131 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// CONFIG
+//
+// RAM cached configuration store over EEPROM
+//
+// the configuration is a structure defined by the application,
+// its fields being the keys (given by their offset in the structure).
+// it is loaded once at init, from the newest valid record of a wear-levelled log
+// (see eep_log.h), or from the defaults if there is none or if its version differs.
+//
+// the reads are done directly in the RAM structure.
+// the writes are done with nnk_cfg_set() and its typed variants,
+// marking the configuration dirty.
+// the dirty configuration is written back by nnk_cfg_poll()
+// once no write happened during NNK_CFG_DELAY, so a burst of writes
+// is coalesced in a single asynchronous EEPROM write.
+//
+// example:
+//
+//	struct my_cfg { u16 speed; u8 mode; };
+//	static const struct my_cfg my_defaults = { 100, 1 };
+//	static struct my_cfg my;
+//	static u8 my_buf[NNK_CFG_BUF(sizeof(my))];
+//	static struct nnk_cfg cfg;
+//
+//	nnk_cfg_init(&cfg, 0x100, 0x100, 1, &my, sizeof(my), &my_defaults, my_buf);
+//	nnk_cfg_set_u16(&cfg, NNK_CFG_KEY(struct my_cfg, speed), 200);
+//	... my.speed ...
+//
+
+#ifndef __CONFIG_H__
+# define __CONFIG_H__
+
+# include <stddef.h>		// offsetof()
+
+# include "type_def.h"
+
+# include "utils/eep_log.h"
+# include "utils/time.h"
+
+
+// delay without write before writing back the configuration (in nnk_time units)
+# ifndef NNK_CFG_DELAY
+#  define NNK_CFG_DELAY		TIME_1_SEC
+# endif
+
+// key of a field of the configuration structure
+# define NNK_CFG_KEY(type, field)	offsetof(type, field)
+
+// size of the buffer for a configuration of len bytes (up to 250)
+# define NNK_CFG_BUF(len)		NNK_EEP_LOG_SLOT((len) + 1)
+
+// init status when the EEPROM is busy
+# define NNK_CFG_BUSY			NNK_EEP_LOG_BUSY
+
+// a configuration store
+// the descriptor and the buffers belong to the caller
+struct nnk_cfg {
+	// private
+	u8* values;		// the configuration structure
+	u8 len;			// its size
+	u8 version;		// its layout version
+	u8* buf;		// record buffer
+
+	u8 dirty;		// changed since the last write back
+	u32 dirty_time;		// time of the last change
+
+	struct nnk_eep_log log;
+};
+
+
+// init the store in the EEPROM region of size bytes from base
+// and load the configuration in values
+// version : layout version of the configuration, to be changed when the structure changes
+// values : configuration structure of len bytes
+// defaults : default configuration of len bytes
+// buf : buffer of NNK_CFG_BUF(len) bytes
+//
+// if the configuration is loaded from EEPROM, it returns OK
+// else the defaults are used and it returns KO
+// if the EEPROM is busy (a write queued by another module), the defaults are used,
+// it returns NNK_CFG_BUSY and nothing is written back:
+// init must be retried once nnk_eep_is_fini()
+extern u8 nnk_cfg_init(struct nnk_cfg* cfg, u16 base, u16 size, u8 version, void* values, u8 len, const void* defaults, u8* buf);
+
+// change len bytes of the configuration from key
+// if the key is out of the configuration, it returns KO else OK
+extern u8 nnk_cfg_set(struct nnk_cfg* cfg, u8 key, const void* data, u8 len);
+
+// typed variants
+extern u8 nnk_cfg_set_u8(struct nnk_cfg* cfg, u8 key, u8 val);
+extern u8 nnk_cfg_set_u16(struct nnk_cfg* cfg, u8 key, u16 val);
+extern u8 nnk_cfg_set_u32(struct nnk_cfg* cfg, u8 key, u32 val);
+
+// write back the dirty configuration after NNK_CFG_DELAY
+// to be called from the main loop
+extern void nnk_cfg_poll(struct nnk_cfg* cfg);
+
+// write back the dirty configuration now (before a reset or a sleep for instance)
+// if the previous write back is not finished, it returns KO else OK
+extern u8 nnk_cfg_flush(struct nnk_cfg* cfg);
+
+// check if the configuration is written back
+extern u8 nnk_cfg_is_fini(const struct nnk_cfg* cfg);
+
+# ifdef __PT_H__
+#  define PT_CFG_WAIT(pt, cfg)				\
+	PT_WAIT_UNTIL((pt), nnk_cfg_is_fini(cfg))
+# endif	// __PT_H__
+
+#endif	// __CONFIG_H__
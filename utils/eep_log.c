@@ -0,0 +1,206 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// EEP_LOG
+//
+// see description in eep_log.h
+//
+
+#include "utils/eep_log.h"
+
+#include <string.h>		// memmove()
+#include <util/crc16.h>		// _crc_ccitt_update()
+
+
+// ---------------------------------------
+// private fonctions
+//
+
+// CRC of the sequence number and the payload of a slot
+static u16 nnk_eep_log_crc(const u8* slot, u8 len)
+{
+	u16 crc = 0xffff;
+	u8 i;
+
+	for ( i = 0; i < len + 2; i++ )
+		crc = _crc_ccitt_update(crc, slot[i]);
+
+	return crc;
+}
+
+
+// EEPROM address of a slot
+static u16 nnk_eep_log_addr(struct nnk_eep_log* log, u16 slot)
+{
+	return log->base + slot * NNK_EEP_LOG_SLOT(log->len);
+}
+
+
+// the records can not be read, the log is left unusable
+// else an append would restart the sequence numbers from 0
+static u8 nnk_eep_log_busy(struct nnk_eep_log* log)
+{
+	log->nb = 0;
+
+	return NNK_EEP_LOG_BUSY;
+}
+
+
+// ---------------------------------------
+// public fonctions
+//
+
+u8 nnk_eep_log_init(struct nnk_eep_log* log, u16 base, u16 size, u8 len, u8* buf)
+{
+	u16 i;
+	u16 seq;
+	u16 best = 0;
+	u16 best_seq = 0;
+	u16 limit = 0;
+	u8 limited = 0;
+	u8 found;
+	u16 crc;
+
+	log->base = base;
+	log->len = len;
+	log->buf = buf;
+	log->req.busy = 0;
+
+	// empty log: the first record will go in the first slot with sequence number 0
+	log->valid = 0;
+	log->nb = ( len <= 0xff - 4 ) ? size / NNK_EEP_LOG_SLOT(len) : 0;
+	log->last = log->nb - 1;
+	log->seq = 0xffff;
+
+	// at least 2 slots are needed to keep the newest record during an append
+	if ( log->nb < 2 )
+		return KO;
+
+	for (;;) {
+		// find the newest record older than the rejected ones
+		found = 0;
+		for ( i = 0; i < log->nb; i++ ) {
+			if ( nnk_eep_read(nnk_eep_log_addr(log, i), buf, 2) == KO )
+				return nnk_eep_log_busy(log);
+
+			seq = buf[0] | (buf[1] << 8);
+
+			// empty slot
+			if ( seq == 0xffff )
+				continue;
+
+			// not older than a rejected record
+			if ( limited && ((s16)(seq - limit) >= 0) )
+				continue;
+
+			if ( !found || ((s16)(seq - best_seq) > 0) ) {
+				best = i;
+				best_seq = seq;
+				found = 1;
+			}
+		}
+
+		// no more record
+		if ( !found )
+			return KO;
+
+		// check its CRC
+		if ( nnk_eep_read(nnk_eep_log_addr(log, best), buf, NNK_EEP_LOG_SLOT(len)) == KO )
+			return nnk_eep_log_busy(log);
+
+		crc = buf[len + 2] | (buf[len + 3] << 8);
+		if ( crc == nnk_eep_log_crc(buf, len) ) {
+			log->last = best;
+			log->seq = best_seq;
+			log->valid = 1;
+
+			return OK;
+		}
+
+		// torn record, try the previous one
+		limit = best_seq;
+		limited = 1;
+	}
+}
+
+
+u8 nnk_eep_log_read(struct nnk_eep_log* log, u8* data)
+{
+	if ( !log->valid )
+		return KO;
+
+	return nnk_eep_read(nnk_eep_log_addr(log, log->last) + 2, data, log->len);
+}
+
+
+u8 nnk_eep_log_append(struct nnk_eep_log* log, const u8* data, void (*done)(void* misc), void* misc)
+{
+	u8* buf = log->buf;
+	u8 len = log->len;
+	u16 slot;
+	u16 seq;
+	u16 crc;
+
+	// previous append not finished or log not usable
+	if ( log->req.busy || (log->nb < 2) )
+		return KO;
+
+	// next slot and sequence number, 0xffff being reserved for empty slots
+	slot = log->last + 1;
+	if ( slot >= log->nb )
+		slot = 0;
+
+	seq = log->seq + 1;
+	if ( seq == 0xffff )
+		seq = 0;
+
+	// build the record
+	// the payload may already lie at the start of the buffer,
+	// so it is moved before the sequence number overwrites it
+	memmove(buf + 2, data, len);
+	buf[0] = seq;
+	buf[1] = seq >> 8;
+	crc = nnk_eep_log_crc(buf, len);
+	buf[len + 2] = crc;
+	buf[len + 3] = crc >> 8;
+
+	// write it asynchronously
+	log->req.addr = nnk_eep_log_addr(log, slot);
+	log->req.data = buf;
+	log->req.len = NNK_EEP_LOG_SLOT(len);
+	log->req.call_back = done;
+	log->req.misc = misc;
+
+	if ( nnk_eep_submit(&log->req) == KO )
+		return KO;
+
+	log->last = slot;
+	log->seq = seq;
+	log->valid = 1;
+
+	return OK;
+}
+
+
+u8 nnk_eep_log_is_fini(const struct nnk_eep_log* log)
+{
+	return nnk_eep_req_is_fini(&log->req);
+}
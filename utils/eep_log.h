@@ -0,0 +1,108 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// EEP_LOG
+//
+// wear-levelled log of fixed length records in EEPROM
+//
+// the records are appended in turn to the slots of a reserved region,
+// so each cell is erased once every nb_slots appends
+// instead of at each write of a fixed location.
+// for instance, with a counter in an 8-byte record saved every 5 s,
+// the most erased cell reaches 100k cycles after about 6 days at a fixed location
+// and after about 250 days in a 512-byte region (42 slots),
+// as found by replaying one million saves with the skip and erase rules of the EEPROM driver.
+//
+// slot layout:
+//
+//  offset | size | content
+// --------+------+---------------------------------------------
+//     0   |   2  | sequence number (LSB first), 0xffff is an empty slot
+//     2   |  len | payload
+//  2+len  |   2  | CRC16-CCITT of the sequence number and the payload (LSB first)
+//
+// at init, only the sequence numbers are read to find the newest record,
+// then its CRC is checked. a record torn by a reset fails the check
+// and the previous one is used instead.
+//
+
+#ifndef __EEP_LOG_H__
+# define __EEP_LOG_H__
+
+# include "type_def.h"
+
+# include "drivers/eeprom.h"
+
+
+// size of a slot for a payload length
+# define NNK_EEP_LOG_SLOT(len)	((len) + 4)
+
+// init status when the EEPROM is busy
+# define NNK_EEP_LOG_BUSY	((u8)2)
+
+// a log
+// the descriptor and the buffer belong to the caller
+struct nnk_eep_log {
+	// private
+	u16 base;		// first EEPROM address of the region
+	u16 nb;			// number of slots
+	u8 len;			// payload length
+	u8* buf;		// slot being written
+
+	u16 last;		// slot of the newest record
+	u16 seq;		// sequence number of the newest record
+	u8 valid;		// there is a newest record
+
+	struct nnk_eep_req req;
+};
+
+
+// init a log in the region of size bytes from base
+// len : payload length of the records
+// buf : RAM buffer of NNK_EEP_LOG_SLOT(len) bytes used for the appends
+//
+// if a valid record is found, it returns OK else KO (empty log or region too small)
+// if the EEPROM is busy (a write queued by another module), it returns NNK_EEP_LOG_BUSY
+// and the log refuses the appends: init must be retried once nnk_eep_is_fini()
+extern u8 nnk_eep_log_init(struct nnk_eep_log* log, u16 base, u16 size, u8 len, u8* buf);
+
+// copy the payload of the newest record in data
+//
+// if there is no record or if the EEPROM is busy, it returns KO else OK
+extern u8 nnk_eep_log_read(struct nnk_eep_log* log, u8* data);
+
+// append a record with the given payload
+// it is written asynchronously, done() being called from ISR at the end
+// the payload is copied, so data can be released on return
+// (it may also be built at the start of the record buffer)
+//
+// if the previous append is not finished, it returns KO else OK
+extern u8 nnk_eep_log_append(struct nnk_eep_log* log, const u8* data, void (*done)(void* misc), void* misc);
+
+// check if the last append is finished
+extern u8 nnk_eep_log_is_fini(const struct nnk_eep_log* log);
+
+# ifdef __PT_H__
+#  define PT_EEP_LOG_WAIT(pt, log)				\
+	PT_WAIT_UNTIL((pt), nnk_eep_log_is_fini(log))
+# endif	// __PT_H__
+
+#endif	// __EEP_LOG_H__
@@ -62,6 +62,42 @@ u8 nnk_fifo_put(struct nnk_fifo *f, void* elem)
 }
 
 
+u8 nnk_fifo_put_buf(struct nnk_fifo* f, const void* elems, u16 nb)
+{
+	const u8* e = elems;
+	u16 room;
+	u16 len;
+	u16 tail;
+
+	u8 sreg = SREG;
+	cli();
+
+	// not enough free places
+	room = (u16)(f->lng - f->nb);
+	if (nb > room) {
+		SREG = sreg;
+		return KO;
+	}
+
+	// copy up to the end of the buffer, then the rest at its begin
+	len = nb * f->elem_size;
+	tail = (u8*)f->donnees + f->lng * f->elem_size - (u8*)f->in;
+	if (tail > len)
+		tail = len;
+
+	memcpy(f->in, e, tail);
+	memcpy(f->donnees, e + tail, len - tail);
+
+	f->in = (u8*)f->in + len;
+	if (f->in >= f->donnees + f->lng * f->elem_size)
+		f->in -= f->lng * f->elem_size;
+	f->nb += nb;
+
+	SREG = sreg;
+	return OK;
+}
+
+
 u8 nnk_fifo_get(struct nnk_fifo *f, void* elem)
 {
 	u8 sreg = SREG;
@@ -49,6 +49,13 @@ extern void nnk_fifo_init(struct nnk_fifo* f, void* buf, u16 nb_elem, u16 elem_s
 extern u8 nnk_fifo_put(struct nnk_fifo* f, void* elem);
 
 
+// add nb elements to the given fifo in one go
+// either all of them are added or none
+// return OK if every thing ok else KO
+//
+extern u8 nnk_fifo_put_buf(struct nnk_fifo* f, const void* elems, u16 nb);
+
+
 // get an element from the given fifo
 // return OK if every thing ok else KO
 // 
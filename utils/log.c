@@ -0,0 +1,232 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// LOG
+//
+// see description in log.h
+//
+
+#include "utils/log.h"
+
+#include <stdarg.h>		// va_list
+#include <string.h>		// memcpy(), strlen()
+
+#include "utils/time.h"
+
+
+// ---------------------------------------
+// private variables
+//
+
+static struct {
+	struct nnk_rs* rs;	// where the records go
+} log;
+
+
+// ---------------------------------------
+// private functions
+//
+
+// record being built on the stack of the caller
+struct nnk_log_rec {
+	u8 args[NNK_LOG_ARGS_LEN];	// raw argument bytes
+	u8 len;			// number of argument bytes
+};
+
+
+// append raw bytes to the record arguments
+static void nnk_log_arg(struct nnk_log_rec* rec, const void* data, u8 len)
+{
+	// truncate what does not fit
+	if ( len > NNK_LOG_ARGS_LEN - rec->len )
+		len = NNK_LOG_ARGS_LEN - rec->len;
+
+	memcpy(rec->args + rec->len, data, len);
+	rec->len += len;
+}
+
+
+// append a string with its ending NUL, even when truncated
+static void nnk_log_str(struct nnk_log_rec* rec, const char* s)
+{
+	size_t len = strlen(s);
+
+	// no room left
+	if ( rec->len >= NNK_LOG_ARGS_LEN )
+		return;
+
+	if ( len > (size_t)(NNK_LOG_ARGS_LEN - rec->len - 1) )
+		len = NNK_LOG_ARGS_LEN - rec->len - 1;
+
+	memcpy(rec->args + rec->len, s, len);
+	rec->len += len;
+	rec->args[rec->len] = '\0';
+	rec->len++;
+}
+
+
+// append raw bytes to the output, escaping the special ones
+static u8 nnk_log_esc(u8* out, const void* data, u8 len)
+{
+	const u8* d = data;
+	u8 n = 0;
+
+	while ( len-- ) {
+		if ( (*d == NNK_LOG_SYNC) || (*d == NNK_LOG_ESC) ) {
+			out[n++] = NNK_LOG_ESC;
+			out[n++] = *d ^ 0x20;
+		}
+		else {
+			out[n++] = *d;
+		}
+		d++;
+	}
+
+	return n;
+}
+
+
+// ---------------------------------------
+// public functions
+//
+
+// init the logging
+void nnk_log_init(struct nnk_rs* rs)
+{
+	log.rs = rs;
+}
+
+
+// emit a record for the given format string in flash
+void nnk_log_P(PGM_P fmt, ...)
+{
+	struct nnk_log_rec rec;
+	// sync byte then each byte of the header and arguments may be escaped
+	u8 out[1 + 2 * (2 + 4 + 1 + NNK_LOG_ARGS_LEN)];
+	u8 n;
+	va_list ap;
+	PGM_P p = fmt;
+	u8 c;
+	u8 lng;
+	u16 addr;
+	u32 t = nnk_time_get();
+	int i;
+	long l;
+	double d;
+	const char* s;
+
+	if ( log.rs == NULL )
+		log.rs = nnk_rs_std();
+
+	rec.len = 0;
+
+	va_start(ap, fmt);
+
+	// only the conversions are scanned, nothing is formatted
+	while ( (c = pgm_read_byte(p++)) != '\0' ) {
+		if ( c != '%' )
+			continue;
+
+		// skip flags, width and precision
+		lng = 0;
+		while ( 1 ) {
+			c = pgm_read_byte(p++);
+
+			if ( c == '*' ) {
+				// width or precision given as argument
+				i = va_arg(ap, int);
+				nnk_log_arg(&rec, &i, sizeof(i));
+			}
+			else if ( c == 'l' ) {
+				lng = 1;
+			}
+			else if ( (c != 'h') && (c != '-') && (c != '+') && (c != ' ') && (c != '#') && (c != '.') && ((c < '0') || (c > '9')) ) {
+				break;
+			}
+		}
+
+		switch ( c ) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			if ( lng ) {
+				l = va_arg(ap, long);
+				nnk_log_arg(&rec, &l, sizeof(l));
+				break;
+			}
+			// fall through
+		case 'c':
+			i = va_arg(ap, int);
+			nnk_log_arg(&rec, &i, sizeof(i));
+			break;
+
+		case 'p':
+		case 'S':
+			// only the address is sent
+			s = va_arg(ap, const char*);
+			addr = (u16)(size_t)s;
+			nnk_log_arg(&rec, &addr, sizeof(addr));
+			break;
+
+		case 's':
+			// the string lives in RAM, so copy it with its NUL
+			s = va_arg(ap, const char*);
+			nnk_log_str(&rec, s);
+			break;
+
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+			d = va_arg(ap, double);
+			nnk_log_arg(&rec, &d, sizeof(d));
+			break;
+
+		case '\0':
+			// truncated conversion at end of format
+			p--;
+			break;
+
+		default:
+			// '%%' and unknown conversions take no argument
+			break;
+		}
+	}
+
+	va_end(ap);
+
+	// build the record
+	addr = (u16)(size_t)fmt;
+	out[0] = NNK_LOG_SYNC;
+	n = 1;
+	n += nnk_log_esc(out + n, &addr, sizeof(addr));
+	n += nnk_log_esc(out + n, &t, sizeof(t));
+	n += nnk_log_esc(out + n, &rec.len, sizeof(rec.len));
+	n += nnk_log_esc(out + n, rec.args, rec.len);
+
+	// and queue it in one go
+	nnk_rs_put_buf(log.rs, out, n);
+}
@@ -0,0 +1,88 @@
+//---------------------
+//  Copyright (C) 2000-2009  <Yann GOUY>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; see the file COPYING.  If not, write to
+//  the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//  Boston, MA 02111-1307, USA.
+//
+//  you can write to me at <yann_gouy@yahoo.fr>
+//
+
+// LOG
+//
+// deferred binary logging:
+// instead of formatting the text on the target,
+// a compact record is emitted for each call:
+//
+//  offset | size | content
+// --------+------+---------------------------------------------
+//     0   |   1  | NNK_LOG_SYNC
+//     1   |   2  | address of the format string in flash (LSB first)
+//     3   |   4  | time given by nnk_time_get() (LSB first)
+//     7   |   1  | number of argument bytes (n)
+//     8   |   n  | raw argument bytes
+//
+// after the NNK_LOG_SYNC byte, any NNK_LOG_SYNC or NNK_LOG_ESC byte
+// of the record is sent as NNK_LOG_ESC followed by the byte XOR 0x20,
+// so the host can always resynchronise on NNK_LOG_SYNC.
+//
+// the record is built on the stack of the caller
+// and queued in one go in the tx fifo of the RS driver,
+// so records logged from ISRs are never interleaved with others.
+// if the fifo has not enough room, the whole record is dropped
+// (see nnk_rs_tx_drop_cnt()).
+//
+// the arguments are copied in the order of the format conversions:
+// - integers, chars and pointers with their AVR size (2 bytes, 4 with 'l'),
+// - floating points on 4 bytes,
+// - '%s' strings with their characters and their ending NUL
+//   (a truncated string is still ended by a NUL),
+// - '%S' strings (in flash) by their address.
+//
+// the host resolves the format string from the ELF file
+// and renders the text.
+//
+
+#ifndef __LOG_H__
+# define __LOG_H__
+
+# include <avr/pgmspace.h>
+
+# include "type_def.h"
+
+# include "drivers/rs.h"
+
+
+# define NNK_LOG_SYNC		0x1e	// record separator
+# define NNK_LOG_ESC		0x1d	// escape of the next byte
+
+// maximum number of argument bytes in a record
+// extra bytes are silently truncated
+# ifndef NNK_LOG_ARGS_LEN
+#  define NNK_LOG_ARGS_LEN	16
+# endif
+
+
+// init the logging
+// the records are written to the given RS instance
+// if NULL, the one bound to stdout is used
+extern void nnk_log_init(struct nnk_rs* rs);
+
+// emit a record for the given format string in flash
+extern void nnk_log_P(PGM_P fmt, ...);
+
+// convenient macro storing the format string in flash
+# define NNK_LOG(fmt, ...)	nnk_log_P(PSTR(fmt), ##__VA_ARGS__)
+
+#endif	// __LOG_H__